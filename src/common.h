@@ -94,37 +94,34 @@ static inline Tcl_Size Tcl_GetStringLengthFromObj(Tcl_Obj *obj) {
 #define TCL_TSD_INIT(keyPtr) \
     (ThreadSpecificData *)Tcl_GetThreadData((keyPtr), sizeof(ThreadSpecificData))
 
-typedef struct treq_LinkedListType {
-    void *item;
-    struct treq_LinkedListType *next;
-} treq_LinkedListType;
-
-#define treq_LinkedListInsert(ll,li) (li)->next = (ll); (ll) = (li)
-#define treq_LinkedListRemoveByItem(ll,i) \
+// Intrusive doubly linked lists. An item can be a member of several lists,
+// each of them uses its own pair of fields in the item: <link>_prev and
+// <link>_next. Insertion and removal take constant time and don't allocate
+// memory.
+#define treq_ListInsert(head,item,link) \
     { \
-        treq_LinkedListType *__prev = NULL; \
-        for (treq_LinkedListType *__cur = (ll); __cur != NULL; __prev = __cur, __cur = __cur->next) { \
-            if (__cur->item != (void *)(i)) continue; \
-            if (__prev == NULL) { (ll) = __cur->next; } else { __prev->next = __cur->next; } \
-            ckfree(__cur); \
-            break; \
-        } \
+        (item)->link##_prev = NULL; \
+        (item)->link##_next = (head); \
+        if ((head) != NULL) { (head)->link##_prev = (item); } \
+        (head) = (item); \
     }
-#define treq_LinkedListNewItem(li,i) \
-    treq_LinkedListType *(li) = ckalloc(sizeof(treq_LinkedListType)); \
-    (li)->item = (void *)(i)
-#define treq_LinkedListInsertNewItem(ll,i) \
+#define treq_ListRemove(head,item,link) \
     { \
-        treq_LinkedListNewItem(__tmpitem, i); \
-        treq_LinkedListInsert((ll), __tmpitem); \
+        if ((item)->link##_prev == NULL) { (head) = (item)->link##_next; } \
+        else { (item)->link##_prev->link##_next = (item)->link##_next; } \
+        if ((item)->link##_next != NULL) { (item)->link##_next->link##_prev = (item)->link##_prev; } \
+        (item)->link##_prev = (item)->link##_next = NULL; \
     }
-#define treq_LinkedListFree(ll) \
-    for (treq_LinkedListType *__cur; (ll) != NULL; __cur = (ll), (ll) = (ll)->next, ckfree(__cur))
 
 typedef struct treq_RequestType treq_RequestType;
 typedef struct treq_SessionType treq_SessionType;
 typedef struct treq_PoolType treq_PoolType;
 typedef struct treq_RequestAuthType treq_RequestAuthType;
+typedef struct treq_IoThreadType treq_IoThreadType;
+typedef struct treq_ShareType treq_ShareType;
+typedef struct treq_RateLimitType treq_RateLimitType;
+typedef struct treq_HostLimitType treq_HostLimitType;
+typedef struct treq_ChannelType treq_ChannelType;
 
 Tcl_Obj *treq_GenerateHeaderContentType(Tcl_Obj *data);
 Tcl_Obj *treq_GenerateHeaderAccept(Tcl_Obj *data);
@@ -9,7 +9,12 @@
 #include "treqSession.h"
 #include "treqRequest.h"
 #include "treqPool.h"
+#include "treqShare.h"
+#include "treqEasyCache.h"
+#include "treqBatch.h"
 #include "treqRequestAuth.h"
+#include "treqRateLimit.h"
+#include "treqChannel.h"
 
 typedef struct treq_optionCommonType {
     const char *name;
@@ -40,6 +45,13 @@ typedef struct treq_optionBooleanType {
     int value;
 } treq_optionBooleanType;
 
+typedef struct treq_optionWideIntType {
+    const char *name;
+    int is_missing;
+    Tcl_Obj *raw;
+    Tcl_WideInt value;
+} treq_optionWideIntType;
+
 typedef struct treq_optionObjectType {
     const char *name;
     int is_missing;
@@ -73,8 +85,14 @@ typedef struct treq_RequestOptions {
     treq_optionListType form;
     treq_optionBooleanType verbose;
     treq_optionBooleanType allow_redirects;
+    treq_optionBooleanType fail_on_error;
     treq_optionObjectType callback;
     treq_optionObjectType callback_debug;
+    treq_optionObjectType on_data;
+    treq_optionObjectType on_headers;
+    treq_optionObjectType output_file;
+    treq_optionBooleanType output_fsync;
+    treq_optionWideIntType max_size;
     treq_optionAuthSchemeType auth_scheme;
     treq_optionObjectType auth_token;
     treq_optionAuthType auth;
@@ -92,10 +110,17 @@ typedef struct treq_RequestOptions {
     treq_optionBooleanType verify_host;
     treq_optionBooleanType verify_peer;
     treq_optionBooleanType verify_status;
+    treq_optionObjectType pool;
+    treq_optionObjectType sharegroup;
+    treq_optionObjectType variable;
+    treq_optionObjectType rate_limit;
     int async;
     int simple;
     int timeout;
     int timeout_connect;
+    int priority;
+    int deadline;
+    int spill_threshold;
 } treq_RequestOptions;
 
 #define treq_InitRequestOptions() { \
@@ -103,8 +128,14 @@ typedef struct treq_RequestOptions {
     .form =                   { "-form",                  -1, NULL, 0 }, \
     .verbose =                { "-verbose",               -1, NULL, 0 }, \
     .allow_redirects =        { "-allow_redirects",       -1, NULL, 0 }, \
+    .fail_on_error =          { "-fail_on_error",         -1, NULL, 0 }, \
     .callback =               { "-callback",              -1, NULL }, \
     .callback_debug =         { "-callback_debug",        -1, NULL }, \
+    .on_data =                { "-on_data",               -1, NULL }, \
+    .on_headers =             { "-on_headers",            -1, NULL }, \
+    .output_file =            { "-output_file",           -1, NULL }, \
+    .output_fsync =           { "-output_fsync",          -1, NULL, 0 }, \
+    .max_size =               { "-max_size",              -1, NULL, -1 }, \
     .auth_scheme =            { "-auth_scheme",           -1, NULL, -1 }, \
     .auth_token =             { "-auth_token",            -1, NULL }, \
     .auth_aws_sigv4 =         { "-auth_aws_sigv4",        -1, NULL, NULL }, \
@@ -122,10 +153,17 @@ typedef struct treq_RequestOptions {
     .verify_host =            { "-verify_host",           -1, NULL, -1 }, \
     .verify_peer =            { "-verify_peer",           -1, NULL, -1 }, \
     .verify_status =          { "-verify_status",         -1, NULL, -1 }, \
+    .pool =                   { "-pool",                  -1, NULL }, \
+    .sharegroup =             { "-sharegroup",            -1, NULL }, \
+    .variable =               { "-variable",              -1, NULL }, \
+    .rate_limit =             { "-rate_limit",            -1, NULL }, \
     .async = 0, \
     .simple = 0, \
     .timeout = -1, \
-    .timeout_connect = -1 \
+    .timeout_connect = -1, \
+    .priority = -1, \
+    .deadline = -1, \
+    .spill_threshold = -1 \
 }
 
 #define treq_FreeRequestOptions(o) \
@@ -186,6 +224,18 @@ static int boolean_arg (void *clientData, Tcl_Obj *objPtr, void *dstPtr) {
     return 1;
 }
 
+static int wideint_arg (void *clientData, Tcl_Obj *objPtr, void *dstPtr) {
+    UNUSED(clientData);
+    treq_optionWideIntType *option_wideint = (treq_optionWideIntType *)dstPtr;
+    if (objPtr == NULL) {
+        option_wideint->is_missing = 1;
+    } else {
+        option_wideint->is_missing = 0;
+        option_wideint->raw = objPtr;
+    }
+    return 1;
+}
+
 static int object_arg(void *clientData, Tcl_Obj *objPtr, void *dstPtr) {
     UNUSED(clientData);
     treq_optionObjectType *option_object = (treq_optionObjectType *)dstPtr;
@@ -581,6 +631,24 @@ static int treq_ValidateOptionBoolean(Tcl_Interp *interp, treq_optionBooleanType
 
 }
 
+// Accepts a non-negative integer or -1
+static int treq_ValidateOptionWideInt(Tcl_Interp *interp, treq_optionWideIntType *data) {
+
+    VALIDATE_COMMON(data);
+
+    if (Tcl_GetWideIntFromObj(NULL, data->raw, &data->value) != TCL_OK || data->value < -1) {
+        DBG2(printf("return: ERROR (%s is wrong: '%s')", data->name, Tcl_GetString(data->raw)));
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as unsigned integer"
+            " value, but got %s", data->name, Tcl_GetString(data->raw)));
+        return TCL_ERROR;
+    }
+
+    DBG2(printf("option %s: %" TCL_LL_MODIFIER "d", data->name, data->value));
+
+    return TCL_OK;
+
+}
+
 static int treq_ValidateOptionObjectList(Tcl_Interp *interp, treq_optionObjectType *data, int allow_empty) {
 
     VALIDATE_COMMON(data);
@@ -662,6 +730,11 @@ static int treq_ValidateOptions(Tcl_Interp *interp, treq_RequestMethodType metho
         treq_ValidateOptionListOfDicts(interp, &opt->form) != TCL_OK                                    ||
         treq_ValidateOptionObjectList(interp, &opt->callback, 1) != TCL_OK                              ||
         treq_ValidateOptionObjectList(interp, &opt->callback_debug, 1) != TCL_OK                        ||
+        treq_ValidateOptionObjectList(interp, &opt->on_data, 1) != TCL_OK                               ||
+        treq_ValidateOptionObjectList(interp, &opt->on_headers, 1) != TCL_OK                            ||
+        treq_ValidateOptionCommon(interp, (treq_optionCommonType *)&opt->output_file) == TCL_ERROR      ||
+        treq_ValidateOptionBoolean(interp, &opt->output_fsync) != TCL_OK                                ||
+        treq_ValidateOptionWideInt(interp, &opt->max_size) != TCL_OK                                    ||
         treq_ValidateOptionObjectList(interp, (treq_optionObjectType *)&opt->auth_scheme, 0) != TCL_OK  ||
         treq_ValidateOptionCommon(interp, (treq_optionCommonType *)&opt->auth_token) == TCL_ERROR       ||
         treq_ValidateOptionAuth(interp, &opt->auth) != TCL_OK                                           ||
@@ -680,7 +753,11 @@ static int treq_ValidateOptions(Tcl_Interp *interp, treq_RequestMethodType metho
         treq_ValidateOptionBoolean(interp, &opt->verify_peer) != TCL_OK                                 ||
         treq_ValidateOptionBoolean(interp, &opt->verify_status) != TCL_OK                               ||
         treq_ValidateOptionBoolean(interp, &opt->verbose) != TCL_OK                                     ||
-        treq_ValidateOptionBoolean(interp, &opt->allow_redirects) != TCL_OK)
+        treq_ValidateOptionBoolean(interp, &opt->allow_redirects) != TCL_OK                             ||
+        treq_ValidateOptionBoolean(interp, &opt->fail_on_error) != TCL_OK                               ||
+        treq_ValidateOptionCommon(interp, (treq_optionCommonType *)&opt->pool) == TCL_ERROR             ||
+        treq_ValidateOptionCommon(interp, (treq_optionCommonType *)&opt->sharegroup) == TCL_ERROR       ||
+        treq_ValidateOptionCommon(interp, (treq_optionCommonType *)&opt->variable) == TCL_ERROR)
     {
         return TCL_ERROR;
     }
@@ -755,6 +832,18 @@ static int treq_ValidateOptions(Tcl_Interp *interp, treq_RequestMethodType metho
         goto mutuallyExclusiveError;
     }
 
+    if (isOptionExists(opt->on_data) && isOptionExists(opt->output_file)) {
+        opt_defined1 = &opt->on_data;
+        opt_defined2 = &opt->output_file;
+        goto mutuallyExclusiveError;
+    }
+
+    if (isOptionExists(opt->output_fsync) && !isOptionExists(opt->output_file)) {
+        DBG2(printf("return: ERROR (-output_fsync without -output_file)"));
+        SetResult("-output_fsync option can only be used with -output_file option");
+        return TCL_ERROR;
+    }
+
     if (isOptionExists(opt->auth_scheme) && treq_RequestAuthParseOption(interp, opt->auth_scheme.raw, &opt->auth_scheme.value) != TCL_OK) {
         return TCL_ERROR;
     }
@@ -797,6 +886,19 @@ static int treq_ValidateOptions(Tcl_Interp *interp, treq_RequestMethodType metho
 
     } else {
 
+        if (opt->simple && isOptionExists(opt->variable)) {
+            DBG2(printf("return: ERROR (both -variable and -simple)"));
+            SetResult("-variable option cannot be used for simple requests");
+            return TCL_ERROR;
+        }
+
+        if (opt->simple && isOptionExists(opt->on_headers)) {
+            DBG2(printf("return: ERROR (both -on_headers and -simple)"));
+            SetResult("-on_headers option cannot be used for simple requests");
+            return TCL_ERROR;
+        }
+
+
         if (isOptionExists(opt->callback)) {
             DBG2(printf("return: ERROR (-callback without -async)"));
             SetResult("-callback option can only be used for async requests");
@@ -823,6 +925,27 @@ static int treq_ValidateOptions(Tcl_Interp *interp, treq_RequestMethodType metho
         return TCL_ERROR;
     }
 
+    if (opt->priority != -1 && (opt->priority < 1 || opt->priority > 256)) {
+        DBG2(printf("return: ERROR (-priority is out of range)"));
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as integer"
+            " value from 1 to 256, but got %d", "-priority", opt->priority));
+        return TCL_ERROR;
+    }
+
+    if (opt->deadline < -1) {
+        DBG2(printf("return: ERROR (-deadline less than -1)"));
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as unsigned integer"
+            " value, but got %d", "-deadline", opt->deadline));
+        return TCL_ERROR;
+    }
+
+    if (opt->spill_threshold < -1) {
+        DBG2(printf("return: ERROR (-spill_threshold less than -1)"));
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as unsigned integer"
+            " value, but got %d", "-spill_threshold", opt->spill_threshold));
+        return TCL_ERROR;
+    }
+
     DBG2(printf("option %s: %s", "-simple", (opt->simple ? "true" : "false")));
     DBG2(printf("option %s: %s", "-async", (opt->async ? "true" : "false")));
     DBG2(printf("option %s: %d", "-timeout", opt->timeout));
@@ -841,6 +964,35 @@ mutuallyExclusiveError:
 
 }
 
+// Parses the "?-timeout milliseconds?" arguments of the wait commands.
+// The first element of objv is skipped.
+static int treq_WaitParseArgs(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[], int *timeout_ptr) {
+
+    int timeout = -1;
+
+    Tcl_ArgvInfo ArgTable[] = {
+        { TCL_ARGV_INT, "-timeout", NULL, &timeout, NULL, NULL },
+        TCL_ARGV_TABLE_END
+    };
+
+    Tcl_Size temp_objc = objc;
+    if (Tcl_ParseArgsObjv(interp, ArgTable, &temp_objc, objv, NULL) != TCL_OK) {
+        DBG2(printf("return: ERROR (failed to parse args)"));
+        return TCL_ERROR;
+    }
+
+    if (timeout < -1) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as unsigned integer"
+            " value, but got %d", "-timeout", timeout));
+        DBG2(printf("return: ERROR (wrong -timeout)"));
+        return TCL_ERROR;
+    }
+
+    *timeout_ptr = timeout;
+    return TCL_OK;
+
+}
+
 static int treq_RequestHandleCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
 
     treq_RequestType *request = (treq_RequestType *)clientData;
@@ -871,6 +1023,9 @@ static int treq_RequestHandleCmd(ClientData clientData, Tcl_Interp *interp, int
         { "encoding",    treq_RequestGetEncoding,   2, 3, "?encoding?" },
         { "status_code", treq_RequestGetStatusCode, 2, 2, NULL         },
         { "state",       treq_RequestGetState,      2, 2, NULL         },
+        { "wait",        NULL,                      2, 4, "?-timeout milliseconds?" },
+        { "resume",      NULL,                      2, 2, NULL         },
+        { "channel",     NULL,                      2, 4, "?-buffer_size bytes?" },
         { "destroy",     NULL,                      2, 2, NULL         },
         { NULL }
     };
@@ -882,7 +1037,7 @@ static int treq_RequestHandleCmd(ClientData clientData, Tcl_Interp *interp, int
         cmdEasyOpts,
 #endif
         cmdText, cmdContent, cmdError, cmdHeaders, cmdHeader, cmdEncoding,
-        cmdStatusCode, cmdState,
+        cmdStatusCode, cmdState, cmdWait, cmdResume, cmdChannel,
         cmdDestroy
     };
 
@@ -904,8 +1059,81 @@ static int treq_RequestHandleCmd(ClientData clientData, Tcl_Interp *interp, int
 
     switch ((enum commands) command) {
     case cmdDestroy:
+        if (request->is_on_data_running) {
+            SetResult("the request cannot be destroyed from its -on_data callback");
+            DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+            return TCL_ERROR;
+        }
+        if (request->is_on_headers_running) {
+            SetResult("the request cannot be destroyed from its -on_headers callback");
+            DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+            return TCL_ERROR;
+        }
+        if (treq_PoolIsInCallback()) {
+            SetResult("the request cannot be destroyed from a transfer callback");
+            DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+            return TCL_ERROR;
+        }
         Tcl_DeleteCommandFromToken(request->interp, request->cmd_token);
         break;
+    case cmdResume:
+        treq_RequestResume(request);
+        break;
+    case cmdChannel: ;
+        Tcl_Size buffer_size = TREQ_CHANNEL_BUFFER_SIZE_DEFAULT;
+        if (objc > 2) {
+            if (objc != 4 || strcmp(Tcl_GetString(objv[2]), "-buffer_size") != 0) {
+                Tcl_WrongNumArgs(interp, 2, objv, commands[command].arg_help);
+                DBG2(printf("return: TCL_ERROR (wrong # args)"));
+                return TCL_ERROR;
+            }
+            if (Tcl_GetSizeIntFromObj(NULL, objv[3], &buffer_size) != TCL_OK || buffer_size <= 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as positive"
+                    " integer value, but got %s", "-buffer_size", Tcl_GetString(objv[3])));
+                DBG2(printf("return: TCL_ERROR (wrong -buffer_size)"));
+                return TCL_ERROR;
+            }
+        }
+        if (request->channel == NULL) {
+            if (request->is_channel_closed) {
+                SetResult("the response channel of the request has been closed");
+                DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+                return TCL_ERROR;
+            }
+            if (request->on_data != NULL || request->output != NULL) {
+                SetResult("the response body of the request is not buffered, as"
+                    " the -on_data or -output_file option is used");
+                DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+                return TCL_ERROR;
+            }
+            if (request->io_thread != NULL) {
+                SetResult("the response channel is not available while the request"
+                    " is served by an I/O thread");
+                DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+                return TCL_ERROR;
+            }
+            if (!treq_RequestReleaseContentObj(request)) {
+                SetResult("failed to allocate memory for the response channel");
+                DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+                return TCL_ERROR;
+            }
+            Tcl_RegisterChannel(interp, treq_ChannelCreate(request, buffer_size));
+        }
+        result = Tcl_NewStringObj(Tcl_GetChannelName(treq_ChannelGet(request->channel)), -1);
+        break;
+    case cmdWait: ;
+        int timeout;
+        if (treq_WaitParseArgs(interp, objc - 1, objv + 1, &timeout) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        int is_completed = treq_PoolWaitRequests(&request, 1, 1, timeout);
+        if (is_completed < 0) {
+            SetResult("failed to wait for the request");
+            DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+            return TCL_ERROR;
+        }
+        result = Tcl_NewBooleanObj(is_completed);
+        break;
     case cmdHeader:
         DBG2(printf("get header: [%s]", Tcl_GetString(objv[2])));
         result = treq_RequestGetHeader(request, Tcl_GetString(objv[2]));
@@ -969,6 +1197,73 @@ static void treq_RequestHandleDelete(ClientData clientData) {
     DBG2(printf("return: ok"));
 }
 
+static int treq_PoolHandleCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    treq_PoolType *pool = (treq_PoolType *)clientData;
+
+    DBG2(printf("enter: objc: %d", objc));
+
+    static const char *const commands[] = {
+        "stats", "destroy", NULL
+    };
+
+    enum commands {
+        cmdStats, cmdDestroy
+    };
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "command");
+        DBG2(printf("return: TCL_ERROR (wrong # args)"));
+        return TCL_ERROR;
+    }
+
+    int command;
+    if (Tcl_GetIndexFromObj(interp, objv[1], commands, "command", 0, &command) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch ((enum commands) command) {
+    case cmdStats:
+        DBG2(printf("get stats"));
+        Tcl_SetObjResult(interp, treq_PoolGetStats(pool));
+        break;
+    case cmdDestroy:
+        DBG2(printf("destroy pool"));
+        if (treq_PoolIsInCallback()) {
+            SetResult("the pool cannot be destroyed from a transfer callback");
+            DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+            return TCL_ERROR;
+        }
+        Tcl_DeleteCommandFromToken(interp, Tcl_GetCommandFromObj(interp, objv[0]));
+        break;
+    }
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
+static void treq_PoolHandleDelete(ClientData clientData) {
+    treq_PoolType *pool = (treq_PoolType *)clientData;
+    DBG2(printf("enter..."));
+    treq_PoolFree(pool);
+    DBG2(printf("return: ok"));
+}
+
+static int treq_PoolGetFromObj(Tcl_Interp *interp, Tcl_Obj *name, treq_PoolType **pool_ptr) {
+
+    Tcl_CmdInfo info;
+
+    if (!Tcl_GetCommandInfo(interp, Tcl_GetString(name), &info) || info.objProc != treq_PoolHandleCmd) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown pool \"%s\"", Tcl_GetString(name)));
+        return TCL_ERROR;
+    }
+
+    *pool_ptr = (treq_PoolType *)info.objClientData;
+    return TCL_OK;
+
+}
+
 #define SetRequestProperty(o,v) \
     (o) = (v); \
     if ((o) != NULL) { Tcl_IncrRefCount(o); }
@@ -976,14 +1271,16 @@ static void treq_RequestHandleDelete(ClientData clientData) {
 #define GetSessionProperty(prop,default) \
     (request->session != NULL ? (request->session->prop) : (default))
 
-static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType method, Tcl_Obj *custom_method,
-    int objc, Tcl_Obj *const objv[], treq_SessionType *session)
+// Parses request options and creates a new request, but doesn't run it.
+// The value of the -simple switch is returned in is_simple_ptr.
+static treq_RequestType *treq_RequestBuild(Tcl_Interp *interp, treq_RequestMethodType method, Tcl_Obj *custom_method,
+    int objc, Tcl_Obj *const objv[], treq_SessionType *session, int *is_simple_ptr)
 {
     DBG2(printf("enter; objc: %d", objc));
 
     Tcl_Obj *url = objv[0];
 
-    int rc = TCL_OK;
+    treq_RequestType *request = NULL;
 
     treq_RequestOptions opt = treq_InitRequestOptions();
 
@@ -995,11 +1292,17 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
         { TCL_ARGV_FUNC, "-headers",               lappend_arg, &opt.headers,               NULL, NULL },
         { TCL_ARGV_FUNC, "-form",                  lappend_arg, &opt.form,                  NULL, NULL },
         { TCL_ARGV_FUNC, "-allow_redirects",       boolean_arg, &opt.allow_redirects,       NULL, NULL },
+        { TCL_ARGV_FUNC, "-fail_on_error",         boolean_arg, &opt.fail_on_error,         NULL, NULL },
         { TCL_ARGV_FUNC, "-verbose",               boolean_arg, &opt.verbose,               NULL, NULL },
         { TCL_ARGV_CONSTANT, "-async",             INT2PTR(1),  &opt.async,                 NULL, NULL },
         { TCL_ARGV_CONSTANT, "-simple",            INT2PTR(1),  &opt.simple,                NULL, NULL },
         { TCL_ARGV_FUNC, "-callback",              object_arg,  &opt.callback,              NULL, NULL },
         { TCL_ARGV_FUNC, "-callback_debug",        object_arg,  &opt.callback_debug,        NULL, NULL },
+        { TCL_ARGV_FUNC, "-on_data",               object_arg,  &opt.on_data,               NULL, NULL },
+        { TCL_ARGV_FUNC, "-on_headers",            object_arg,  &opt.on_headers,            NULL, NULL },
+        { TCL_ARGV_FUNC, "-output_file",           object_arg,  &opt.output_file,           NULL, NULL },
+        { TCL_ARGV_FUNC, "-output_fsync",          boolean_arg, &opt.output_fsync,          NULL, NULL },
+        { TCL_ARGV_FUNC, "-max_size",              wideint_arg, &opt.max_size,              NULL, NULL },
         { TCL_ARGV_FUNC, "-auth",                  object_arg,  &opt.auth,                  NULL, NULL },
         { TCL_ARGV_FUNC, "-auth_token",            object_arg,  &opt.auth_token,            NULL, NULL },
         { TCL_ARGV_FUNC, "-auth_scheme",           object_arg,  &opt.auth_scheme,           NULL, NULL },
@@ -1019,6 +1322,11 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
         { TCL_ARGV_FUNC, "-verify_host",           boolean_arg, &opt.verify_host,           NULL, NULL },
         { TCL_ARGV_FUNC, "-verify_peer",           boolean_arg, &opt.verify_peer,           NULL, NULL },
         { TCL_ARGV_FUNC, "-verify_status",         boolean_arg, &opt.verify_status,           NULL, NULL },
+        { TCL_ARGV_FUNC, "-pool",                  object_arg,  &opt.pool,                  NULL, NULL },
+        { TCL_ARGV_FUNC, "-variable",              object_arg,  &opt.variable,              NULL, NULL },
+        { TCL_ARGV_INT,  "-priority",              NULL,        &opt.priority,              NULL, NULL },
+        { TCL_ARGV_INT,  "-deadline",              NULL,        &opt.deadline,              NULL, NULL },
+        { TCL_ARGV_INT,  "-spill_threshold",       NULL,        &opt.spill_threshold,       NULL, NULL },
         TCL_ARGV_TABLE_END
     };
 #pragma GCC diagnostic pop
@@ -1034,7 +1342,38 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
         goto error;
     }
 
-    treq_RequestType *request;
+    treq_PoolType *pool = NULL;
+
+    if (opt.async) {
+
+        Tcl_Obj *pool_name = isOptionExists(opt.pool) ? opt.pool.value :
+            (session != NULL ? session->pool : NULL);
+
+        if (pool_name != NULL && treq_PoolGetFromObj(interp, pool_name, &pool) != TCL_OK) {
+            DBG2(printf("return: ERROR (failed to get the pool)"));
+            goto error;
+        }
+
+    } else if (isOptionExists(opt.pool)) {
+        DBG2(printf("return: ERROR (-pool without -async)"));
+        SetResult("-pool option can only be used for async requests");
+        goto error;
+    }
+
+    const char *output_path = NULL;
+
+    if (isOptionExists(opt.output_file)) {
+        if (Tcl_GetCharLength(opt.output_file.value) != 0) {
+            output_path = Tcl_FSGetNativePath(opt.output_file.value);
+        }
+        if (output_path == NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected to be a valid"
+                " file name, but got: %s", opt.output_file.name, Tcl_GetString(opt.output_file.value)));
+            DBG2(printf("return: ERROR (%s)", Tcl_GetStringResult(interp)));
+            goto error;
+        }
+    }
+
     if (session == NULL) {
         request = treq_RequestInit();
     } else {
@@ -1047,6 +1386,11 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
         goto error;
     }
 
+    if (session == NULL && treq_ShareDefaultGet() != NULL) {
+        DBG2(printf("use the default share"));
+        treq_RequestSetShare(request, treq_ShareDefaultGet());
+    }
+
     SetRequestProperty(request->headers, isOptionExists(opt.headers) ?
         treq_MergeDicts(request->session == NULL ? NULL : request->session->headers, opt.headers.value, 1) :
         GetSessionProperty(headers, NULL));
@@ -1061,7 +1405,14 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
         opt.callback_debug.value :
         GetSessionProperty(callback_debug, NULL));
 
+    SetRequestProperty(request->on_data, opt.on_data.value);
+    SetRequestProperty(request->on_headers, opt.on_headers.value);
+
+    if (output_path != NULL) {
+        request->output = treq_OutputInit(output_path, opt.output_fsync.value);
+    }
     SetRequestProperty(request->form, opt.form.value);
+    SetRequestProperty(request->variable, opt.variable.value);
 
     if (isOptionExists(opt.auth_scheme) || isOptionExists(opt.auth_token) || isOptionExists(opt.auth) || isOptionExists(opt.auth_aws_sigv4)) {
 
@@ -1149,6 +1500,11 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
         (request->session != NULL && request->session->allow_redirects != -1) ? request->session->allow_redirects :
         1;
 
+    request->fail_on_error =
+        isOptionExists(opt.fail_on_error) ? opt.fail_on_error.value :
+        (request->session != NULL && request->session->fail_on_error != -1) ? request->session->fail_on_error :
+        0;
+
     request->verbose =
         isOptionExists(opt.verbose) ? opt.verbose.value :
         (request->session != NULL && request->session->verbose != -1) ? request->session->verbose :
@@ -1164,13 +1520,79 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
         request->session != NULL ? request->session->timeout_connect :
         -1;
 
+    request->max_size =
+        isOptionExists(opt.max_size) ? opt.max_size.value :
+        request->session != NULL ? request->session->max_size :
+        -1;
+
+    // If the threshold is not defined for the request and its session,
+    // the pool can define it when the request is added
+    request->content.spill_threshold =
+        opt.spill_threshold != -1 ? opt.spill_threshold :
+        request->session != NULL ? request->session->spill_threshold :
+        -1;
+
     request->async = opt.async;
+    request->async_pool = pool;
+
+    request->priority = opt.priority;
+    if (opt.deadline != -1) {
+        Tcl_Time now;
+        Tcl_GetTime(&now);
+        request->deadline = (Tcl_WideInt)now.sec * 1000 + now.usec / 1000 + opt.deadline;
+    }
 
     request->interp = interp;
 
+    *is_simple_ptr = opt.simple;
+
+    DBG2(printf("return: ok (%p)", (void *)request));
+    goto done;
+
+error:
+    request = NULL;
+
+done:
+    treq_FreeRequestOptions(opt);
+    return request;
+
+}
+
+static void treq_RequestCreateCommand(Tcl_Interp *interp, treq_RequestType *request) {
+
+    request->cmd_token = treq_CreateObjCommand(interp, "::trequests::request::handler%p",
+        treq_RequestHandleCmd, (ClientData)request, treq_RequestHandleDelete);
+
+    request->cmd_name = Tcl_GetObjResult(interp);
+    Tcl_IncrRefCount(request->cmd_name);
+
+}
+
+static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType method, Tcl_Obj *custom_method,
+    int objc, Tcl_Obj *const objv[], treq_SessionType *session)
+{
+    DBG2(printf("enter; objc: %d", objc));
+
+    int rc = TCL_OK;
+    int is_simple;
+
+    treq_RequestType *request = treq_RequestBuild(interp, method, custom_method, objc, objv,
+        session, &is_simple);
+
+    if (request == NULL) {
+        DBG2(printf("return: ERROR (failed to build the request)"));
+        return TCL_ERROR;
+    }
+
+    // The -on_headers callback of a sync request is called during
+    // the transfer, and it needs the response handle
+    if (!is_simple && !request->async && request->on_headers != NULL) {
+        treq_RequestCreateCommand(interp, request);
+    }
+
     treq_RequestRun(request);
 
-    if (opt.simple) {
+    if (is_simple) {
 
         switch (request->state) {
         case TREQ_REQUEST_DONE:
@@ -1181,6 +1603,7 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
             rc = TCL_ERROR;
             break;
         case TREQ_REQUEST_CREATED:
+        case TREQ_REQUEST_QUEUED:
         case TREQ_REQUEST_INPROGRESS:
             SetResult("request is in wrong state");
             break;
@@ -1188,24 +1611,38 @@ static int treq_CreateNewRequest(Tcl_Interp *interp, treq_RequestMethodType meth
 
         treq_RequestFree(request);
 
-        goto done;
+        DBG2(printf("return: %s (simple request)", (rc == TCL_OK ? "ok" : "ERROR")));
+        return rc;
 
     }
 
-    request->cmd_token = treq_CreateObjCommand(interp, "::trequests::request::handler%p",
-        treq_RequestHandleCmd, (ClientData)request, treq_RequestHandleDelete);
-
-    request->cmd_name = Tcl_GetObjResult(interp);
-    Tcl_IncrRefCount(request->cmd_name);
-
-    goto done;
-
-error:
-    rc = TCL_ERROR;
+    if (request->cmd_name == NULL) {
+        treq_RequestCreateCommand(interp, request);
+    } else {
+        Tcl_SetObjResult(interp, request->cmd_name);
+    }
+
+    // Async requests set the variable when they are completed. For sync
+    // request, the variable is set right now. In both cases, the variable
+    // is global so that the request can be used with vwait.
+    if (!request->async && request->variable != NULL) {
+        DBG2(printf("set variable: %s", Tcl_GetString(request->variable)));
+        // Variable traces can destroy the request, don't use it after
+        // setting the variable
+        Tcl_Obj *cmd_name = request->cmd_name;
+        Tcl_IncrRefCount(cmd_name);
+        if (Tcl_ObjSetVar2(interp, request->variable, NULL, cmd_name, TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
+            Tcl_DeleteCommand(interp, Tcl_GetString(cmd_name));
+            Tcl_DecrRefCount(cmd_name);
+            DBG2(printf("return: ERROR (failed to set the variable)"));
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, cmd_name);
+        Tcl_DecrRefCount(cmd_name);
+    }
 
-done:
-    treq_FreeRequestOptions(opt);
-    return rc;
+    DBG2(printf("return: ok"));
+    return TCL_OK;
 
 }
 
@@ -1250,34 +1687,379 @@ static int treq_RequestCmd(ClientData clientData, Tcl_Interp *interp, int objc,
 
 }
 
-static int treq_SessionHandleCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+static int treq_RequestGetFromObj(Tcl_Interp *interp, Tcl_Obj *name, treq_RequestType **request_ptr) {
 
-    treq_SessionType *session = (treq_SessionType *)clientData;
+    Tcl_CmdInfo info;
 
-    DBG2(printf("enter: objc: %d", objc));
+    if (!Tcl_GetCommandInfo(interp, Tcl_GetString(name), &info) || info.objProc != treq_RequestHandleCmd) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown request \"%s\"", Tcl_GetString(name)));
+        return TCL_ERROR;
+    }
+
+    *request_ptr = (treq_RequestType *)info.objClientData;
+    return TCL_OK;
+
+}
+
+// Implements both ::trequests::wait_any and ::trequests::wait_all. The type
+// of the command is defined by clientData.
+static int treq_WaitCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    int wait_all = PTR2INT(clientData);
+
+    DBG2(printf("enter; wait_all: %d objc: %d", wait_all, objc));
 
     if (objc < 2) {
-wrongNumArgs:
-        Tcl_WrongNumArgs(interp, 1, objv, "method url ?options?");
-        // Unfortunately, we do not have access to INTERP_ALTERNATE_WRONG_ARGS
-        // from the extension. Let's simulate it.
-        Tcl_AppendPrintfToObj(Tcl_GetObjResult(interp), " or \"%s request method url ?options?\"", Tcl_GetString(objv[0]));
-        Tcl_AppendPrintfToObj(Tcl_GetObjResult(interp), " or \"%s destroy\"", Tcl_GetString(objv[0]));
+        Tcl_WrongNumArgs(interp, 1, objv, "requests ?-timeout milliseconds?");
         DBG2(printf("return: TCL_ERROR (wrong # args)"));
         return TCL_ERROR;
     }
 
-    enum commands {
-        cmdRequest, cmdCustomRequest, cmdDestroy
-    };
+    // Skip the requests argument
+    int timeout;
+    if (treq_WaitParseArgs(interp, objc - 1, objv + 1, &timeout) != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-    static const struct {
-        const char *name;
-        enum commands cmd;
-        treq_RequestMethodType method;
-    } commands[] = {
-        { "head",    cmdRequest,       TREQ_METHOD_HEAD   },
-        { "get",     cmdRequest,       TREQ_METHOD_GET    },
+    Tcl_Size reqc;
+    Tcl_Obj **reqv;
+    if (Tcl_ListObjGetElements(interp, objv[1], &reqc, &reqv) != TCL_OK) {
+        DBG2(printf("return: ERROR (requests is not a list)"));
+        return TCL_ERROR;
+    }
+
+    treq_RequestType *requests_static[16], **requests = requests_static;
+    if (reqc > 16) {
+        requests = ckalloc(sizeof(treq_RequestType *) * reqc);
+    }
+
+    int rc = TCL_OK;
+
+    for (Tcl_Size i = 0; i < reqc; i++) {
+        if (treq_RequestGetFromObj(interp, reqv[i], &requests[i]) != TCL_OK) {
+            DBG2(printf("return: ERROR (unknown request)"));
+            rc = TCL_ERROR;
+            goto done;
+        }
+    }
+
+    int is_completed = treq_PoolWaitRequests(requests, reqc, wait_all, timeout);
+
+    if (is_completed < 0) {
+        SetResult("failed to wait for the requests");
+        DBG2(printf("return: ERROR (%s)", Tcl_GetStringResult(interp)));
+        rc = TCL_ERROR;
+        goto done;
+    }
+
+    if (wait_all) {
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(is_completed));
+    } else {
+        // Return the first completed request in the order of the list
+        Tcl_Obj *result = NULL;
+        for (Tcl_Size i = 0; i < reqc && result == NULL; i++) {
+            if (treq_RequestIsCompleted(requests[i])) {
+                result = reqv[i];
+            }
+        }
+        Tcl_SetObjResult(interp, (result == NULL ? Tcl_NewObj() : result));
+    }
+
+    DBG2(printf("return: ok (%s)", (is_completed ? "completed" : "timeout")));
+
+done:
+    if (requests != requests_static) {
+        ckfree(requests);
+    }
+    return rc;
+
+}
+
+// Runs after the coroutine suspended by ::trequests::await is resumed.
+// data[0] is the request handle command with an incremented refcount.
+static int treq_AwaitCallback(ClientData data[], Tcl_Interp *interp, int result) {
+
+    Tcl_Obj *cmd_name = (Tcl_Obj *)data[0];
+
+    DBG2(printf("enter; request: %s", Tcl_GetString(cmd_name)));
+
+    // If the request still has the coroutine, the coroutine was resumed
+    // or deleted before the request was completed. Make sure the request
+    // will not try to resume it. If the request no longer exists, it was
+    // destroyed while the coroutine was waiting for it.
+    Tcl_CmdInfo info;
+    if (!Tcl_GetCommandInfo(interp, Tcl_GetString(cmd_name), &info) || info.objProc != treq_RequestHandleCmd) {
+        DBG2(printf("the request is destroyed"));
+        if (result == TCL_OK) {
+            SetResult("the request has been destroyed");
+            result = TCL_ERROR;
+        }
+    } else {
+        treq_RequestType *request = (treq_RequestType *)info.objClientData;
+        if (request->await_coro != NULL) {
+            DBG2(printf("the request is not completed"));
+            Tcl_FreeObject(request->await_coro);
+            if (result == TCL_OK) {
+                SetResult("the coroutine was resumed before the request was completed");
+                result = TCL_ERROR;
+            }
+        }
+    }
+
+    Tcl_DecrRefCount(cmd_name);
+
+    DBG2(printf("return: %s", (result == TCL_OK ? "ok" : "ERROR")));
+    return result;
+
+}
+
+static int treq_AwaitNRCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    UNUSED(clientData);
+
+    DBG2(printf("enter; objc: %d", objc));
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "request");
+        DBG2(printf("return: TCL_ERROR (wrong # args)"));
+        return TCL_ERROR;
+    }
+
+    treq_RequestType *request;
+    if (treq_RequestGetFromObj(interp, objv[1], &request) != TCL_OK) {
+        DBG2(printf("return: ERROR (unknown request)"));
+        return TCL_ERROR;
+    }
+
+    if (treq_RequestIsCompleted(request)) {
+        Tcl_SetObjResult(interp, request->cmd_name);
+        DBG2(printf("return: ok (the request is completed)"));
+        return TCL_OK;
+    }
+
+    if (request->await_coro != NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("the request is already awaited by"
+            " the coroutine \"%s\"", Tcl_GetString(request->await_coro)));
+        DBG2(printf("return: ERROR (already awaited)"));
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *info_coroutine[2] = {
+        Tcl_NewStringObj("::info", -1),
+        Tcl_NewStringObj("coroutine", -1)
+    };
+    Tcl_IncrRefCount(info_coroutine[0]);
+    Tcl_IncrRefCount(info_coroutine[1]);
+    int rc = Tcl_EvalObjv(interp, 2, info_coroutine, 0);
+    Tcl_DecrRefCount(info_coroutine[0]);
+    Tcl_DecrRefCount(info_coroutine[1]);
+
+    if (rc != TCL_OK) {
+        DBG2(printf("return: ERROR (failed to get the coroutine)"));
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *coro = Tcl_GetObjResult(interp);
+    if (Tcl_GetCharLength(coro) == 0) {
+        SetResult("::trequests::await can only be called from within a coroutine");
+        DBG2(printf("return: ERROR (not in a coroutine)"));
+        return TCL_ERROR;
+    }
+
+    DBG2(printf("coroutine: %s", Tcl_GetString(coro)));
+
+    request->await_coro = coro;
+    Tcl_IncrRefCount(request->await_coro);
+
+    Tcl_IncrRefCount(request->cmd_name);
+    Tcl_NRAddCallback(interp, treq_AwaitCallback, (ClientData)request->cmd_name, NULL, NULL, NULL);
+
+    // Suspend the coroutine. It will be resumed with the request handle
+    // command when the request is completed, and this will be the result
+    // of the yield.
+    Tcl_Obj *yield = Tcl_NewStringObj("::yield", -1);
+    DBG2(printf("return: yield"));
+    return Tcl_NREvalObj(interp, Tcl_NewListObj(1, &yield), 0);
+
+}
+
+static int treq_AwaitCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    return Tcl_NRCallObjProc(interp, treq_AwaitNRCmd, clientData, objc, objv);
+}
+
+static int treq_BatchCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    UNUSED(clientData);
+
+    DBG2(printf("enter; objc: %d", objc));
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "specs ?-concurrency number? ?-timeout milliseconds?");
+        DBG2(printf("return: TCL_ERROR (wrong # args)"));
+        return TCL_ERROR;
+    }
+
+    int concurrency = -1;
+    int timeout = -1;
+
+    Tcl_ArgvInfo ArgTable[] = {
+        { TCL_ARGV_INT, "-concurrency", NULL, &concurrency, NULL, NULL },
+        { TCL_ARGV_INT, "-timeout",     NULL, &timeout,     NULL, NULL },
+        TCL_ARGV_TABLE_END
+    };
+
+    // Skip the specs argument
+    Tcl_Size temp_objc = objc - 1;
+    if (Tcl_ParseArgsObjv(interp, ArgTable, &temp_objc, objv + 1, NULL) != TCL_OK) {
+        DBG2(printf("return: ERROR (failed to parse args)"));
+        return TCL_ERROR;
+    }
+
+    if (concurrency != -1 && concurrency < 1) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as positive integer"
+            " value, but got %d", "-concurrency", concurrency));
+        DBG2(printf("return: ERROR (wrong -concurrency)"));
+        return TCL_ERROR;
+    }
+
+    if (timeout < -1) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as unsigned integer"
+            " value, but got %d", "-timeout", timeout));
+        DBG2(printf("return: ERROR (wrong -timeout)"));
+        return TCL_ERROR;
+    }
+
+    Tcl_Size specc;
+    Tcl_Obj **specv;
+    if (Tcl_ListObjGetElements(interp, objv[1], &specc, &specv) != TCL_OK) {
+        DBG2(printf("return: ERROR (specs is not a list)"));
+        return TCL_ERROR;
+    }
+
+    int rc = TCL_OK;
+
+    treq_RequestType **requests = NULL;
+    Tcl_Size count = 0;
+
+    if (specc > 0) {
+        requests = ckalloc(sizeof(treq_RequestType *) * specc);
+    }
+
+    for (; count < specc; count++) {
+
+        Tcl_Size argc;
+        Tcl_Obj **argv;
+        if (Tcl_ListObjGetElements(interp, specv[count], &argc, &argv) != TCL_OK) {
+            goto error;
+        }
+
+        if (argc < 2) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("batch request spec is expected to be"
+                " a list \"method url ?options?\", but got: \"%s\"", Tcl_GetString(specv[count])));
+            goto error;
+        }
+
+        treq_RequestMethodType method = TREQ_METHOD_CUSTOM;
+        Tcl_Obj *custom_method = argv[0];
+
+        int idx;
+        if (Tcl_GetIndexFromObjStruct(NULL, argv[0], known_methods, sizeof(known_methods[0]), NULL, TCL_EXACT, &idx) == TCL_OK) {
+            method = known_methods[idx].method;
+            custom_method = NULL;
+        }
+
+        DBG2(printf("spec #%" TCL_SIZE_MODIFIER "d: [%s]", count, Tcl_GetString(specv[count])));
+
+        int is_simple;
+        treq_RequestType *request = treq_RequestBuild(interp, method, custom_method, argc - 1, argv + 1,
+            NULL, &is_simple);
+
+        if (request == NULL) {
+            goto error;
+        }
+
+        if (is_simple || request->async) {
+            treq_RequestFree(request);
+            SetResult("-async and -simple switches are not supported by batch requests");
+            goto error;
+        }
+
+        if (request->variable != NULL) {
+            treq_RequestFree(request);
+            SetResult("-variable option is not supported by batch requests");
+            goto error;
+        }
+
+        if (request->on_headers != NULL) {
+            treq_RequestFree(request);
+            SetResult("-on_headers option is not supported by batch requests");
+            goto error;
+        }
+
+        requests[count] = request;
+
+    }
+
+    treq_BatchRun(requests, count, (concurrency == -1 ? count : concurrency), timeout);
+
+    Tcl_Obj *result = Tcl_NewListObj(count, NULL);
+    for (Tcl_Size i = 0; i < count; i++) {
+        treq_RequestCreateCommand(interp, requests[i]);
+        Tcl_ListObjAppendElement(NULL, result, requests[i]->cmd_name);
+    }
+    Tcl_SetObjResult(interp, result);
+
+    DBG2(printf("return: ok"));
+    goto done;
+
+error:
+
+    DBG2(printf("return: ERROR (failed to build request #%" TCL_SIZE_MODIFIER "d)", count));
+
+    for (Tcl_Size i = 0; i < count; i++) {
+        treq_RequestFree(requests[i]);
+    }
+
+    rc = TCL_ERROR;
+
+done:
+
+    if (requests != NULL) {
+        ckfree(requests);
+    }
+
+    return rc;
+
+}
+
+static int treq_SessionHandleCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    treq_SessionType *session = (treq_SessionType *)clientData;
+
+    DBG2(printf("enter: objc: %d", objc));
+
+    if (objc < 2) {
+wrongNumArgs:
+        Tcl_WrongNumArgs(interp, 1, objv, "method url ?options?");
+        // Unfortunately, we do not have access to INTERP_ALTERNATE_WRONG_ARGS
+        // from the extension. Let's simulate it.
+        Tcl_AppendPrintfToObj(Tcl_GetObjResult(interp), " or \"%s request method url ?options?\"", Tcl_GetString(objv[0]));
+        Tcl_AppendPrintfToObj(Tcl_GetObjResult(interp), " or \"%s destroy\"", Tcl_GetString(objv[0]));
+        DBG2(printf("return: TCL_ERROR (wrong # args)"));
+        return TCL_ERROR;
+    }
+
+    enum commands {
+        cmdRequest, cmdCustomRequest, cmdDestroy
+    };
+
+    static const struct {
+        const char *name;
+        enum commands cmd;
+        treq_RequestMethodType method;
+    } commands[] = {
+        { "head",    cmdRequest,       TREQ_METHOD_HEAD   },
+        { "get",     cmdRequest,       TREQ_METHOD_GET    },
         { "post",    cmdRequest,       TREQ_METHOD_POST   },
         { "put",     cmdRequest,       TREQ_METHOD_PUT    },
         { "patch",   cmdRequest,       TREQ_METHOD_PATCH  },
@@ -1300,6 +2082,11 @@ wrongNumArgs:
         if (objc != 2) {
             goto wrongNumArgs;
         }
+        if (treq_PoolIsInCallback()) {
+            SetResult("the session cannot be destroyed from a transfer callback");
+            DBG2(printf("return: TCL_ERROR (%s)", Tcl_GetStringResult(interp)));
+            return TCL_ERROR;
+        }
         Tcl_DeleteCommandFromToken(session->interp, session->cmd_token);
         break;
     case cmdCustomRequest:
@@ -1360,6 +2147,7 @@ static int treq_SessionCmd(ClientData clientData, Tcl_Interp *interp, int objc,
     Tcl_ArgvInfo ArgTable[] = {
         { TCL_ARGV_FUNC, "-headers",         lappend_arg, &opt.headers,         NULL, NULL },
         { TCL_ARGV_FUNC, "-allow_redirects", boolean_arg, &opt.allow_redirects, NULL, NULL },
+        { TCL_ARGV_FUNC, "-fail_on_error",   boolean_arg, &opt.fail_on_error,   NULL, NULL },
         { TCL_ARGV_FUNC, "-verbose",         boolean_arg, &opt.verbose,         NULL, NULL },
         { TCL_ARGV_FUNC, "-callback",        object_arg,  &opt.callback,        NULL, NULL },
         { TCL_ARGV_FUNC, "-callback_debug",  object_arg,  &opt.callback_debug,  NULL, NULL },
@@ -1371,10 +2159,15 @@ static int treq_SessionCmd(ClientData clientData, Tcl_Interp *interp, int objc,
         { TCL_ARGV_FUNC, "-content_type",    object_arg,  &opt.content_type,    NULL, NULL },
         { TCL_ARGV_INT,  "-timeout",         NULL,        &opt.timeout,         NULL, NULL },
         { TCL_ARGV_INT,  "-timeout_connect", NULL,        &opt.timeout_connect, NULL, NULL },
+        { TCL_ARGV_INT,  "-spill_threshold", NULL,        &opt.spill_threshold, NULL, NULL },
+        { TCL_ARGV_FUNC, "-max_size",        wideint_arg, &opt.max_size,        NULL, NULL },
         { TCL_ARGV_FUNC, "-verify",          boolean_arg, &opt.verify,          NULL, NULL },
         { TCL_ARGV_FUNC, "-verify_host",     boolean_arg, &opt.verify_host,     NULL, NULL },
         { TCL_ARGV_FUNC, "-verify_peer",     boolean_arg, &opt.verify_peer,     NULL, NULL },
         { TCL_ARGV_FUNC, "-verify_status",   boolean_arg, &opt.verify_status,   NULL, NULL },
+        { TCL_ARGV_FUNC, "-pool",            object_arg,  &opt.pool,            NULL, NULL },
+        { TCL_ARGV_FUNC, "-sharegroup",      object_arg,  &opt.sharegroup,      NULL, NULL },
+        { TCL_ARGV_FUNC, "-rate_limit",      object_arg,  &opt.rate_limit,      NULL, NULL },
         TCL_ARGV_TABLE_END
     };
 #pragma GCC diagnostic pop
@@ -1390,13 +2183,44 @@ static int treq_SessionCmd(ClientData clientData, Tcl_Interp *interp, int objc,
         goto error;
     }
 
-    treq_SessionType *session = treq_SessionInit();
+    treq_RateLimitType *rate_limit = NULL;
+    if (isOptionExists(opt.rate_limit)) {
+        rate_limit = treq_RateLimitFromObj(interp, opt.rate_limit.value);
+        if (rate_limit == NULL) {
+            DBG2(printf("return: ERROR (wrong -rate_limit)"));
+            goto error;
+        }
+        treq_RateLimitIncrRefCount(rate_limit);
+    }
+
+    treq_ShareType *share = NULL;
+    if (isOptionExists(opt.sharegroup)) {
+        share = treq_ShareGroupGet(interp, opt.sharegroup.value);
+        if (share == NULL) {
+            if (rate_limit != NULL) {
+                treq_RateLimitDecrRefCount(rate_limit);
+            }
+            DBG2(printf("return: ERROR (failed to get the share group)"));
+            goto error;
+        }
+    }
+
+    treq_SessionType *session = treq_SessionInit(share);
     if (session == NULL) {
+        if (share != NULL) {
+            treq_ShareDecrRefCount(share);
+        }
+        if (rate_limit != NULL) {
+            treq_RateLimitDecrRefCount(rate_limit);
+        }
         SetResult("failed to alloc");
         DBG2(printf("return: ERROR (failed to alloc)"));
         goto error;
     }
 
+    // The session takes the reference to the rate limiter
+    session->rate_limit = rate_limit;
+
     if (isOptionExists(opt.headers)) {
         session->headers = treq_MergeDicts(NULL, opt.headers.value, 1);
         Tcl_IncrRefCount(session->headers);
@@ -1430,6 +2254,14 @@ static int treq_SessionCmd(ClientData clientData, Tcl_Interp *interp, int objc,
         Tcl_IncrRefCount(session->content_type);
     }
 
+    // The session keeps the name of the pool, not the pool itself. The pool
+    // can be destroyed before the session, and the name will be resolved
+    // each time an async request is created.
+    if (isOptionExists(opt.pool)) {
+        session->pool = opt.pool.value;
+        Tcl_IncrRefCount(session->pool);
+    }
+
     session->verify = isOptionExists(opt.verify) ? opt.verify.value : -1;
     session->verify_host = isOptionExists(opt.verify_host) ? opt.verify_host.value : -1;
     session->verify_peer = isOptionExists(opt.verify_peer) ? opt.verify_peer.value : -1;
@@ -1437,8 +2269,11 @@ static int treq_SessionCmd(ClientData clientData, Tcl_Interp *interp, int objc,
 
     session->allow_redirects = isOptionExists(opt.allow_redirects) ? opt.allow_redirects.value : -1;
     session->verbose = isOptionExists(opt.verbose) ? opt.verbose.value : -1;
+    session->fail_on_error = isOptionExists(opt.fail_on_error) ? opt.fail_on_error.value : -1;
     session->timeout = opt.timeout;
     session->timeout_connect = opt.timeout_connect;
+    session->spill_threshold = opt.spill_threshold;
+    session->max_size = isOptionExists(opt.max_size) ? opt.max_size.value : -1;
 
     session->interp = interp;
     session->cmd_token = treq_CreateObjCommand(interp, "::trequests::session::handler%p",
@@ -1456,6 +2291,251 @@ done:
 
 }
 
+static int treq_PoolCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    UNUSED(clientData);
+
+    DBG2(printf("enter; objc: %d", objc));
+
+    static const char *const commands[] = {
+        "create", NULL
+    };
+
+    enum commands {
+        cmdCreate
+    };
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "command ?options?");
+        DBG2(printf("return: TCL_ERROR (wrong # args)"));
+        return TCL_ERROR;
+    }
+
+    int command;
+    if (Tcl_GetIndexFromObj(interp, objv[1], commands, "command", 0, &command) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    int max_total_connections = -1;
+    int max_host_connections = -1;
+    int max_connects = -1;
+    int max_in_flight = -1;
+    int adaptive_limit = -1;
+    int spill_threshold = -1;
+    int io_threads = 0;
+    treq_optionBooleanType multiplex = { "-multiplex", -1, NULL, -1 };
+    treq_optionWideIntType memory_budget = { "-memory_budget", -1, NULL, -1 };
+    treq_optionObjectType rate_limit_obj = { "-rate_limit", -1, NULL };
+    treq_optionObjectType callback_batch = { "-callback_batch", -1, NULL };
+
+#pragma GCC diagnostic push
+// ignore warning for copy_arg:
+//     warning: ISO C forbids conversion of function pointer to object pointer type [-Wpedantic]
+#pragma GCC diagnostic ignored "-Wpedantic"
+    Tcl_ArgvInfo ArgTable[] = {
+        { TCL_ARGV_INT,  "-max_total_connections", NULL,        &max_total_connections, NULL, NULL },
+        { TCL_ARGV_INT,  "-max_host_connections",  NULL,        &max_host_connections,  NULL, NULL },
+        { TCL_ARGV_INT,  "-max_connects",          NULL,        &max_connects,          NULL, NULL },
+        { TCL_ARGV_FUNC, "-multiplex",             boolean_arg, &multiplex,             NULL, NULL },
+        { TCL_ARGV_INT,  "-max_in_flight",         NULL,        &max_in_flight,         NULL, NULL },
+        { TCL_ARGV_INT,  "-io_threads",            NULL,        &io_threads,            NULL, NULL },
+        { TCL_ARGV_INT,  "-adaptive_limit",        NULL,        &adaptive_limit,        NULL, NULL },
+        { TCL_ARGV_INT,  "-spill_threshold",       NULL,        &spill_threshold,       NULL, NULL },
+        { TCL_ARGV_FUNC, "-memory_budget",         wideint_arg, &memory_budget,         NULL, NULL },
+        { TCL_ARGV_FUNC, "-rate_limit",            object_arg,  &rate_limit_obj,        NULL, NULL },
+        { TCL_ARGV_FUNC, "-callback_batch",        object_arg,  &callback_batch,        NULL, NULL },
+        TCL_ARGV_TABLE_END
+    };
+#pragma GCC diagnostic pop
+
+    // Skip the "create" subcommand. Tcl_ParseArgsObjv() expects that
+    // the first argument is a command name and it doesn't parse it.
+    Tcl_Size temp_objc = objc - 1;
+    if (Tcl_ParseArgsObjv(interp, ArgTable, &temp_objc, objv + 1, NULL) != TCL_OK) {
+        DBG2(printf("return: ERROR (failed to parse args)"));
+        return TCL_ERROR;
+    }
+
+    if (treq_ValidateOptionBoolean(interp, &multiplex) != TCL_OK ||
+        treq_ValidateOptionWideInt(interp, &memory_budget) != TCL_OK)
+    {
+        DBG2(printf("return: ERROR (failed to validate)"));
+        return TCL_ERROR;
+    }
+
+    // Write callbacks of I/O threads cannot pause and resume transfers
+    // of other threads
+    if (isOptionExists(memory_budget) && memory_budget.value != -1 && io_threads > 0) {
+        SetResult("-memory_budget option cannot be used with -io_threads option");
+        DBG2(printf("return: ERROR (-memory_budget with -io_threads)"));
+        return TCL_ERROR;
+    }
+
+#define checkUnsignedOption(name,value) \
+    if ((value) < -1) { \
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as unsigned integer" \
+            " value, but got %d", (name), (value))); \
+        DBG2(printf("return: ERROR (%s less than -1)", (name))); \
+        return TCL_ERROR; \
+    }
+
+    checkUnsignedOption("-max_total_connections", max_total_connections);
+    checkUnsignedOption("-max_host_connections", max_host_connections);
+    checkUnsignedOption("-max_connects", max_connects);
+    checkUnsignedOption("-spill_threshold", spill_threshold);
+
+#undef checkUnsignedOption
+
+#define checkPositiveOption(name,value) \
+    if ((value) < -1 || (value) == 0) { \
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as positive integer" \
+            " value or -1, but got %d", (name), (value))); \
+        DBG2(printf("return: ERROR (wrong %s)", (name))); \
+        return TCL_ERROR; \
+    }
+
+    checkPositiveOption("-max_in_flight", max_in_flight);
+    checkPositiveOption("-adaptive_limit", adaptive_limit);
+
+#undef checkPositiveOption
+
+    treq_RateLimitType *rate_limit = NULL;
+    if (isOptionExists(rate_limit_obj)) {
+        rate_limit = treq_RateLimitFromObj(interp, rate_limit_obj.value);
+        if (rate_limit == NULL) {
+            DBG2(printf("return: ERROR (wrong -rate_limit)"));
+            return TCL_ERROR;
+        }
+        treq_RateLimitIncrRefCount(rate_limit);
+    }
+
+    treq_PoolOptionsType options = treq_InitPoolOptions();
+    options.max_total_connections = max_total_connections;
+    options.max_host_connections = max_host_connections;
+    options.max_connects = max_connects;
+    options.multiplex = isOptionExists(multiplex) ? multiplex.value : -1;
+    options.max_in_flight = max_in_flight;
+    options.adaptive_limit = adaptive_limit;
+    options.spill_threshold = spill_threshold;
+    options.memory_budget = isOptionExists(memory_budget) ? memory_budget.value : -1;
+
+    treq_PoolType *pool = treq_PoolInit(&options);
+    if (pool == NULL) {
+        if (rate_limit != NULL) {
+            treq_RateLimitDecrRefCount(rate_limit);
+        }
+        SetResult("failed to create a pool");
+        DBG2(printf("return: ERROR (failed to create a pool)"));
+        return TCL_ERROR;
+    }
+
+    // The pool takes the reference to the rate limiter
+    treq_PoolSetRateLimit(pool, rate_limit);
+
+    if (isOptionExists(callback_batch)) {
+        treq_PoolSetCallbackBatch(pool, callback_batch.value);
+    }
+
+    if (treq_PoolSetIoThreads(interp, pool, io_threads) != TCL_OK) {
+        treq_PoolFree(pool);
+        DBG2(printf("return: ERROR (failed to set I/O threads)"));
+        return TCL_ERROR;
+    }
+
+    treq_CreateObjCommand(interp, "::trequests::pool::handler%p",
+        treq_PoolHandleCmd, (ClientData)pool, treq_PoolHandleDelete);
+
+    DBG2(printf("return: ok (%s)", Tcl_GetStringResult(interp)));
+    return TCL_OK;
+
+}
+
+static int treq_ShareGroupCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    UNUSED(clientData);
+
+    DBG2(printf("enter; objc: %d", objc));
+
+    static const char *const commands[] = {
+        "create", "destroy", "names", NULL
+    };
+
+    enum commands {
+        cmdCreate, cmdDestroy, cmdNames
+    };
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "command ?args?");
+        DBG2(printf("return: TCL_ERROR (wrong # args)"));
+        return TCL_ERROR;
+    }
+
+    int command;
+    if (Tcl_GetIndexFromObj(interp, objv[1], commands, "command", 0, &command) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    int rc = TCL_OK;
+
+    switch ((enum commands) command) {
+    case cmdCreate:
+
+        if (objc != 3 && objc != 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, "name ?-scope scope?");
+            DBG2(printf("return: TCL_ERROR (wrong # args)"));
+            return TCL_ERROR;
+        }
+
+        int scope = TREQ_SHARE_GROUP_DEFAULT_SCOPE;
+
+        if (objc == 5) {
+            if (strcmp(Tcl_GetString(objv[3]), "-scope") != 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad option \"%s\": must be -scope",
+                    Tcl_GetString(objv[3])));
+                DBG2(printf("return: TCL_ERROR (unknown option)"));
+                return TCL_ERROR;
+            }
+            if (treq_ShareScopeFromObj(interp, objv[4], &scope) != TCL_OK) {
+                DBG2(printf("return: TCL_ERROR (wrong scope)"));
+                return TCL_ERROR;
+            }
+        }
+
+        rc = treq_ShareGroupCreate(interp, objv[2], scope);
+        if (rc == TCL_OK) {
+            Tcl_SetObjResult(interp, objv[2]);
+        }
+        break;
+
+    case cmdDestroy:
+
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "name");
+            DBG2(printf("return: TCL_ERROR (wrong # args)"));
+            return TCL_ERROR;
+        }
+
+        rc = treq_ShareGroupDestroy(interp, objv[2]);
+        break;
+
+    case cmdNames:
+
+        if (objc != 2) {
+            Tcl_WrongNumArgs(interp, 2, objv, NULL);
+            DBG2(printf("return: TCL_ERROR (wrong # args)"));
+            return TCL_ERROR;
+        }
+
+        Tcl_SetObjResult(interp, treq_ShareGroupNames());
+        break;
+
+    }
+
+    DBG2(printf("return: %s", (rc == TCL_OK ? "ok" : "ERROR")));
+    return rc;
+
+}
+
 static int treq_CurlVersionCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
 
     UNUSED(clientData);
@@ -1578,6 +2658,140 @@ done:
 
 }
 
+static const char *const configure_options[] = {
+    "-io_threads", "-easy_cache_size", "-share", "-sync_via_pool", "-max_in_flight", NULL
+};
+
+enum configure_options {
+    optIoThreads, optEasyCacheSize, optShare, optSyncViaPool, optMaxInFlight
+};
+
+static Tcl_Obj *treq_ConfigureGetOption(enum configure_options opt) {
+    switch (opt) {
+    case optIoThreads:
+        return Tcl_NewIntObj(treq_PoolDefaultGetIoThreads());
+    case optEasyCacheSize:
+        return Tcl_NewIntObj(treq_EasyCacheGetSize());
+    case optShare:
+        return treq_ShareDefaultGetScope();
+    case optSyncViaPool:
+        return Tcl_NewBooleanObj(treq_PoolDefaultGetSyncViaPool());
+    case optMaxInFlight:
+        return Tcl_NewIntObj(treq_PoolDefaultGetMaxInFlight());
+    }
+    return NULL; // <- we should not reach here, but it is necessary to avoid compiler warnings
+}
+
+static int treq_ConfigureSetOption(Tcl_Interp *interp, enum configure_options opt, Tcl_Obj *value) {
+
+    int int_value;
+
+    switch (opt) {
+    case optIoThreads:
+        if (Tcl_GetIntFromObj(interp, value, &int_value) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return treq_PoolDefaultSetIoThreads(interp, int_value);
+    case optEasyCacheSize:
+        if (Tcl_GetIntFromObj(interp, value, &int_value) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return treq_EasyCacheSetSize(interp, int_value);
+    case optShare:
+        return treq_ShareDefaultSetScope(interp, value);
+    case optSyncViaPool:
+        if (Tcl_GetBooleanFromObj(interp, value, &int_value) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        treq_PoolDefaultSetSyncViaPool(int_value);
+        return TCL_OK;
+    case optMaxInFlight:
+        if (Tcl_GetIntFromObj(interp, value, &int_value) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return treq_PoolDefaultSetMaxInFlight(interp, int_value);
+    }
+
+    return TCL_OK;
+
+}
+
+static int treq_ConfigureCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    UNUSED(clientData);
+
+    DBG2(printf("enter; objc: %d", objc));
+
+    int opt;
+
+    if (objc == 1) {
+
+        Tcl_Obj *result = Tcl_NewDictObj();
+        for (opt = 0; configure_options[opt] != NULL; opt++) {
+            Tcl_DictObjPut(NULL, result, Tcl_NewStringObj(configure_options[opt], -1),
+                treq_ConfigureGetOption((enum configure_options)opt));
+        }
+        Tcl_SetObjResult(interp, result);
+
+        DBG2(printf("return: ok (all options)"));
+        return TCL_OK;
+
+    }
+
+    if (objc == 2) {
+
+        if (Tcl_GetIndexFromObj(interp, objv[1], configure_options, "option", 0, &opt) != TCL_OK) {
+            DBG2(printf("return: ERROR (unknown option)"));
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, treq_ConfigureGetOption((enum configure_options)opt));
+
+        DBG2(printf("return: ok (%s)", configure_options[opt]));
+        return TCL_OK;
+
+    }
+
+    if ((objc % 2) != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-option? ?value -option value ...?");
+        DBG2(printf("return: TCL_ERROR (wrong # args)"));
+        return TCL_ERROR;
+    }
+
+    for (int i = 1; i < objc; i += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], configure_options, "option", 0, &opt) != TCL_OK ||
+            treq_ConfigureSetOption(interp, (enum configure_options)opt, objv[i + 1]) != TCL_OK)
+        {
+            DBG2(printf("return: ERROR (failed to set %s)", Tcl_GetString(objv[i])));
+            return TCL_ERROR;
+        }
+    }
+
+    Tcl_ResetResult(interp);
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
+static int treq_StatsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+
+    UNUSED(clientData);
+
+    DBG2(printf("enter; objc: %d", objc));
+
+    if (objc != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, NULL);
+        DBG2(printf("return: TCL_ERROR (wrong # args)"));
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, treq_EasyCacheGetStats());
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
 #if TCL_MAJOR_VERSION > 8
 #define MIN_VERSION "9.0"
 #else
@@ -1618,6 +2832,7 @@ int Trequests_Init(Tcl_Interp *interp) {
     Tcl_CreateNamespace(interp, "::trequests", NULL, NULL);
     Tcl_CreateNamespace(interp, "::trequests::session", NULL, NULL);
     Tcl_CreateNamespace(interp, "::trequests::request", NULL, NULL);
+    Tcl_CreateNamespace(interp, "::trequests::pool", NULL, NULL);
 
     Tcl_CreateObjCommand(interp, "::trequests::request", treq_RequestCmd,
         NULL, NULL);
@@ -1642,8 +2857,23 @@ int Trequests_Init(Tcl_Interp *interp) {
 
     Tcl_CreateObjCommand(interp, "::trequests::session", treq_SessionCmd, NULL, NULL);
 
+    Tcl_CreateObjCommand(interp, "::trequests::batch", treq_BatchCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::trequests::wait_any", treq_WaitCmd, INT2PTR(0), NULL);
+    Tcl_CreateObjCommand(interp, "::trequests::wait_all", treq_WaitCmd, INT2PTR(1), NULL);
+
+    Tcl_NRCreateCommand(interp, "::trequests::await", treq_AwaitCmd, treq_AwaitNRCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::trequests::pool", treq_PoolCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::trequests::sharegroup", treq_ShareGroupCmd, NULL, NULL);
+
     Tcl_CreateObjCommand(interp, "::trequests::curl_version", treq_CurlVersionCmd, NULL, NULL);
 
+    Tcl_CreateObjCommand(interp, "::trequests::configure", treq_ConfigureCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::trequests::stats", treq_StatsCmd, NULL, NULL);
+
     Tcl_RegisterConfig(interp, "trequests", treq_pkgconfig, "iso8859-1");
 
     DBG2(printf("return: ok"));
@@ -1662,7 +2892,10 @@ static void treq_PackageThreadExitProc(ClientData clientData) {
     UNUSED(clientData);
     DBG2(printf("enter... tid: %p", (void *)Tcl_GetCurrentThread()));
     treq_SessionThreadExitProc();
+    treq_RequestThreadExitProc();
     treq_PoolThreadExitProc();
+    treq_EasyCacheThreadExitProc();
+    treq_ShareThreadExitProc();
     if (glob.is_shutdown) {
         DBG2(printf("shutdown cURL"));
         curl_global_cleanup();
@@ -1675,5 +2908,6 @@ static void treq_PackageExitProc(ClientData clientData) {
     UNUSED(clientData);
     DBG2(printf("enter... tid: %p", (void *)Tcl_GetCurrentThread()));
     glob.is_shutdown = 1;
+    treq_ShareGroupExitProc();
     DBG2(printf("return: ok"));
 }
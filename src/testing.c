@@ -34,6 +34,7 @@ static const struct {
     { "CURLOPT_HTTPAUTH",          TREQ_OPT_LONG    },
     { "CURLOPT_MIMEPOST",          TREQ_OPT_POINTER },
     { "CURLOPT_FOLLOWLOCATION",    TREQ_OPT_LONG    },
+    { "CURLOPT_FAILONERROR",       TREQ_OPT_LONG    },
     { "CURLOPT_VERBOSE",           TREQ_OPT_LONG    },
     { "CURLOPT_HTTPHEADER",        TREQ_OPT_SLIST   },
     { "CURLOPT_CONNECTTIMEOUT_MS", TREQ_OPT_LONG    },
@@ -41,6 +42,8 @@ static const struct {
     { "CURLOPT_SSL_VERIFYHOST",    TREQ_OPT_LONG    },
     { "CURLOPT_SSL_VERIFYPEER",    TREQ_OPT_LONG    },
     { "CURLOPT_SSL_VERIFYSTATUS",  TREQ_OPT_LONG    },
+    { "CURLOPT_STREAM_WEIGHT",     TREQ_OPT_LONG    },
+    { "CURLOPT_MAXFILESIZE_LARGE", TREQ_OPT_LONG    },
     /* curl_url */
     { "CURLUPART_URL",             TREQ_OPT_STRING  },
     { "CURLUPART_QUERY",           TREQ_OPT_STRING  },
@@ -0,0 +1,168 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqBatch.h"
+#include "treqRequest.h"
+
+// Returns the number of milliseconds until the deadline
+static long treq_BatchGetRemainingTime(const Tcl_Time *deadline) {
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (deadline->sec - now.sec) * 1000 + (deadline->usec - now.usec) / 1000;
+}
+
+// Runs the specified requests concurrently using a private multi handle
+// and returns when all of them are completed. No more than concurrency
+// transfers are active at the same time. If timeout is not -1, transfers
+// that are not completed within timeout milliseconds are terminated
+// with an error. The result of each request is stored in the request.
+void treq_BatchRun(treq_RequestType **requests, Tcl_Size count, Tcl_Size concurrency, int timeout) {
+
+    DBG2(printf("enter; count: %" TCL_SIZE_MODIFIER "d concurrency: %" TCL_SIZE_MODIFIER "d"
+        " timeout: %d", count, concurrency, timeout));
+
+    Tcl_Size next = 0;
+    Tcl_Size running = 0;
+    const char *error = NULL;
+
+    Tcl_Time deadline = { 0, 0 };
+    if (timeout != -1) {
+        Tcl_GetTime(&deadline);
+        deadline.sec += timeout / 1000;
+        deadline.usec += (timeout % 1000) * 1000;
+        if (deadline.usec >= 1000000) {
+            deadline.sec++;
+            deadline.usec -= 1000000;
+        }
+    }
+
+    // The requests that failed to prepare are already in the error state.
+    // They will be skipped below.
+    for (Tcl_Size i = 0; i < count; i++) {
+        treq_RequestPrepare(requests[i]);
+    }
+
+    CURLM *curl_multi = curl_multi_init();
+    if (curl_multi == NULL) {
+        error = "failed to create a multi handle for the batch";
+        goto terminate;
+    }
+
+    for (;;) {
+
+        // Start new transfers while we have free slots
+        while (running < concurrency && next < count) {
+
+            treq_RequestType *req = requests[next++];
+
+            if (req->state != TREQ_REQUEST_INPROGRESS) {
+                continue;
+            }
+
+            if (curl_multi_add_handle(curl_multi, req->curl_easy) != CURLM_OK) {
+                treq_RequestSetError(req, Tcl_NewStringObj("failed to add the request to the batch", -1));
+                continue;
+            }
+
+            DBG2(printf("start request #%" TCL_SIZE_MODIFIER "d", next - 1));
+            running++;
+
+        }
+
+        if (running == 0) {
+            DBG2(printf("all requests are completed"));
+            break;
+        }
+
+        // Check the deadline on every pass. Passes that complete requests
+        // don't wait below, and a large batch can run through them for
+        // a long time.
+        long remaining = -1;
+        if (timeout != -1) {
+            remaining = treq_BatchGetRemainingTime(&deadline);
+            if (remaining <= 0) {
+                error = "batch timeout has expired";
+                goto terminate;
+            }
+        }
+
+        int still_running;
+        if (curl_multi_perform(curl_multi, &still_running) != CURLM_OK) {
+            error = "curl_multi_perform failed";
+            goto terminate;
+        }
+
+        CURLMsg *msg;
+        int msgs_left;
+        int is_completed = 0;
+
+        while ((msg = curl_multi_info_read(curl_multi, &msgs_left)) != NULL) {
+
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            treq_RequestType *req;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &req);
+
+            DBG2(printf("request %p completed with %s", (void *)req,
+                (msg->data.result == CURLE_OK ? "OK" : "ERROR")));
+
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(curl_multi, req->curl_easy);
+            treq_RequestComplete(req, result);
+
+            running--;
+            is_completed = 1;
+
+        }
+
+        // Fill the released slots without waiting
+        if (is_completed) {
+            continue;
+        }
+
+        int wait = 1000;
+
+        if (remaining != -1 && remaining < wait) {
+            wait = (int)remaining;
+        }
+
+        if (curl_multi_poll(curl_multi, NULL, 0, wait, NULL) != CURLM_OK) {
+            error = "curl_multi_poll failed";
+            goto terminate;
+        }
+
+    }
+
+    goto done;
+
+terminate:
+
+    DBG2(printf("terminate the batch: %s", error));
+
+    // Terminate all requests that are not completed, including those
+    // that have not been started yet
+    for (Tcl_Size i = 0; i < count; i++) {
+        treq_RequestType *req = requests[i];
+        if (req->state != TREQ_REQUEST_INPROGRESS) {
+            continue;
+        }
+        if (i < next && curl_multi != NULL) {
+            curl_multi_remove_handle(curl_multi, req->curl_easy);
+        }
+        treq_RequestSetError(req, Tcl_NewStringObj(error, -1));
+    }
+
+done:
+
+    if (curl_multi != NULL) {
+        curl_multi_cleanup(curl_multi);
+    }
+
+    DBG2(printf("return: ok"));
+
+}
@@ -0,0 +1,21 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQBATCH_H
+#define TREQUESTS_TREQBATCH_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void treq_BatchRun(treq_RequestType **requests, Tcl_Size count, Tcl_Size concurrency, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQBATCH_H
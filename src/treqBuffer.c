@@ -0,0 +1,295 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqBuffer.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+void treq_BufferInit(treq_BufferType *buf) {
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+    buf->failed_size = 0;
+    buf->spill_threshold = -1;
+    buf->spill_fd = -1;
+    buf->spill_error = 0;
+    buf->map = NULL;
+    buf->map_size = 0;
+}
+
+static void treq_BufferUnmap(treq_BufferType *buf) {
+    if (buf->map != NULL) {
+        munmap(buf->map, buf->map_size);
+        buf->map = NULL;
+        buf->map_size = 0;
+    }
+}
+
+void treq_BufferFree(treq_BufferType *buf) {
+    if (buf->data != NULL) {
+        ckfree(buf->data);
+    }
+    treq_BufferUnmap(buf);
+    if (buf->spill_fd != -1) {
+        close(buf->spill_fd);
+    }
+    treq_BufferInit(buf);
+}
+
+static int treq_BufferRealloc(treq_BufferType *buf, Tcl_Size capacity) {
+
+    DBG2(printf("enter; capacity: %" TCL_SIZE_MODIFIER "d -> %" TCL_SIZE_MODIFIER "d",
+        buf->capacity, capacity));
+
+    char *data = attemptckrealloc(buf->data, capacity);
+    if (data == NULL) {
+        DBG2(printf("return: ERROR (failed to alloc)"));
+        return 0;
+    }
+
+    buf->data = data;
+    buf->capacity = capacity;
+
+    DBG2(printf("return: ok"));
+    return 1;
+
+}
+
+// Writes the data to the temporary file at the specified offset
+static int treq_BufferFileWrite(treq_BufferType *buf, const char *ptr, size_t size, Tcl_Size offset) {
+
+    while (size > 0) {
+        ssize_t written = pwrite(buf->spill_fd, ptr, size, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DBG2(printf("return: ERROR (%s)", strerror(errno)));
+            buf->spill_error = errno;
+            return 0;
+        }
+        ptr += written;
+        size -= (size_t)written;
+        offset += written;
+    }
+
+    return 1;
+
+}
+
+// Moves the content to an unlinked temporary file. If the file cannot
+// be created, the content stays in memory and the buffer doesn't try
+// to spill again.
+static void treq_BufferSpill(treq_BufferType *buf) {
+
+    const char *tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL || tmpdir[0] == '\0') {
+        tmpdir = P_tmpdir;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/trequests.XXXXXX", tmpdir);
+
+    DBG2(printf("enter; size: %" TCL_SIZE_MODIFIER "d template: [%s]", buf->size, path));
+
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        DBG2(printf("return: ERROR (failed to create a file: %s)", strerror(errno)));
+        buf->spill_threshold = -1;
+        return;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // The file is removed when it is closed
+    unlink(path);
+
+    buf->spill_fd = fd;
+
+    if (!treq_BufferFileWrite(buf, buf->data, buf->size, 0)) {
+        DBG2(printf("return: ERROR (failed to write the file, keep the content in memory)"));
+        close(fd);
+        buf->spill_fd = -1;
+        buf->spill_error = 0;
+        buf->spill_threshold = -1;
+        return;
+    }
+
+    if (buf->data != NULL) {
+        ckfree(buf->data);
+        buf->data = NULL;
+        buf->capacity = 0;
+    }
+
+    DBG2(printf("return: ok"));
+
+}
+
+// Makes sure that the buffer can hold the specified number of bytes
+// in total without reallocation. It is used when the size of the content
+// is known in advance. Returns 0 if the memory could not be allocated.
+int treq_BufferReserve(treq_BufferType *buf, size_t size) {
+
+    if (size > (size_t)TCL_SIZE_MAX) {
+        return 0;
+    }
+
+    if ((Tcl_Size)size <= buf->capacity) {
+        return 1;
+    }
+
+    // The content that will be spilled should not take the memory
+    if (treq_BufferIsSpilled(buf) || (buf->spill_threshold >= 0 && (Tcl_Size)size > buf->spill_threshold)) {
+        return 1;
+    }
+
+    return treq_BufferRealloc(buf, (Tcl_Size)size);
+
+}
+
+// Adds the chunk to the buffer. The capacity is doubled when more space
+// is needed, so the number of reallocations is logarithmic in the size of
+// the content. On memory allocation error, the buffer is not changed,
+// the size of the chunk is remembered and 0 is returned. On error of
+// the temporary file, its errno is remembered and 0 is returned.
+int treq_BufferAppend(treq_BufferType *buf, const char *ptr, size_t size) {
+
+    if (size == 0) {
+        return 1;
+    }
+
+    if (size > (size_t)(TCL_SIZE_MAX - buf->size)) {
+        goto error;
+    }
+
+    Tcl_Size need = buf->size + (Tcl_Size)size;
+
+    if (buf->spill_threshold >= 0 && need > buf->spill_threshold && !treq_BufferIsSpilled(buf)) {
+        treq_BufferSpill(buf);
+    }
+
+    if (treq_BufferIsSpilled(buf)) {
+        if (!treq_BufferFileWrite(buf, ptr, size, buf->size)) {
+            return 0;
+        }
+        buf->size = need;
+        return 1;
+    }
+
+    if (need > buf->capacity) {
+
+        Tcl_Size capacity = (buf->capacity < TREQ_BUFFER_MIN_CAPACITY ?
+            TREQ_BUFFER_MIN_CAPACITY : buf->capacity);
+        while (capacity < need) {
+            capacity = (capacity > TCL_SIZE_MAX / 2 ? TCL_SIZE_MAX : capacity * 2);
+        }
+
+        // If we failed to double the buffer, try to allocate only
+        // the required size
+        if (!treq_BufferRealloc(buf, capacity) && (capacity == need || !treq_BufferRealloc(buf, need))) {
+            goto error;
+        }
+
+    }
+
+    memcpy(buf->data + buf->size, ptr, size);
+    buf->size = need;
+
+    return 1;
+
+error:
+    buf->failed_size = size;
+    return 0;
+
+}
+
+// Releases the unused space of the buffer. It is called when the content
+// is complete. If the memory could not be reallocated, the buffer is left
+// as is.
+void treq_BufferShrink(treq_BufferType *buf) {
+
+    if (treq_BufferIsSpilled(buf) || buf->size == buf->capacity) {
+        return;
+    }
+
+    if (buf->size == 0) {
+        DBG2(printf("free empty buffer"));
+        ckfree(buf->data);
+        buf->data = NULL;
+        buf->capacity = 0;
+        return;
+    }
+
+    treq_BufferRealloc(buf, buf->size);
+
+}
+
+// Removes the specified number of bytes from the beginning of the buffer.
+// The capacity of the buffer is not changed, so the buffer can be reused
+// for the next chunks. The content of the temporary file can only be
+// removed entirely. Returns 0 if the data has not been removed.
+int treq_BufferDiscard(treq_BufferType *buf, Tcl_Size size) {
+
+    if (size >= buf->size) {
+        if (treq_BufferIsSpilled(buf)) {
+            treq_BufferUnmap(buf);
+            // Release the disk space, the next chunks are written
+            // from the beginning of the file
+            if (ftruncate(buf->spill_fd, 0) != 0) {
+                DBG2(printf("failed to truncate the file: %s", strerror(errno)));
+            }
+        }
+        buf->size = 0;
+        return 1;
+    }
+
+    if (treq_BufferIsSpilled(buf)) {
+        return 0;
+    }
+
+    memmove(buf->data, buf->data + size, buf->size - size);
+    buf->size -= size;
+
+    return 1;
+
+}
+
+// Returns the pointer to the content. If the content is in the temporary
+// file, the file is mapped to memory. Returns NULL if there is no content
+// or the file cannot be mapped.
+const char *treq_BufferGetData(treq_BufferType *buf) {
+
+    if (!treq_BufferIsSpilled(buf)) {
+        return buf->data;
+    }
+
+    if (buf->size == 0) {
+        return NULL;
+    }
+
+    // The file has grown since it was mapped
+    if (buf->map != NULL && buf->map_size != buf->size) {
+        treq_BufferUnmap(buf);
+    }
+
+    if (buf->map == NULL) {
+        DBG2(printf("map the file, size: %" TCL_SIZE_MODIFIER "d", buf->size));
+        void *map = mmap(NULL, (size_t)buf->size, PROT_READ, MAP_SHARED, buf->spill_fd, 0);
+        if (map == MAP_FAILED) {
+            DBG2(printf("return: ERROR (failed to map the file: %s)", strerror(errno)));
+            return NULL;
+        }
+        buf->map = map;
+        buf->map_size = buf->size;
+    }
+
+    return buf->map;
+
+}
@@ -0,0 +1,62 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQBUFFER_H
+#define TREQUESTS_TREQBUFFER_H
+
+#include "common.h"
+
+// Response buffer. We don't use Tcl_Obj or DString to store the content,
+// as we don't want to crash on a memory allocation error. A memory
+// allocation error is very likely when we download something unknown from
+// network. The buffer can be filled by an I/O thread, so it doesn't use
+// any Tcl objects.
+//
+// When the size of the content exceeds the spill threshold, the content
+// is moved to an unlinked temporary file, and the memory is released.
+// The file is mapped to memory when the content is requested, so that
+// the kernel can evict its pages when memory is needed.
+typedef struct treq_BufferType {
+    char *data;
+    Tcl_Size size;
+    Tcl_Size capacity;
+    // The size of the chunk that we failed to add to the buffer. The error
+    // is reported when the request is completed.
+    size_t failed_size;
+    // The size of the content in memory after which the content is moved
+    // to a temporary file, or -1 if the content is always kept in memory
+    Tcl_Size spill_threshold;
+    // The temporary file with the content, or -1 if the content is
+    // in memory. The errno of the failed file operation is reported when
+    // the request is completed.
+    int spill_fd;
+    int spill_error;
+    // The mapping of the temporary file and its size
+    char *map;
+    Tcl_Size map_size;
+} treq_BufferType;
+
+// The minimum capacity of a buffer that grows without a known size
+#define TREQ_BUFFER_MIN_CAPACITY 16384
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void treq_BufferInit(treq_BufferType *buf);
+void treq_BufferFree(treq_BufferType *buf);
+int treq_BufferReserve(treq_BufferType *buf, size_t size);
+int treq_BufferAppend(treq_BufferType *buf, const char *ptr, size_t size);
+void treq_BufferShrink(treq_BufferType *buf);
+int treq_BufferDiscard(treq_BufferType *buf, Tcl_Size size);
+const char *treq_BufferGetData(treq_BufferType *buf);
+
+#define treq_BufferIsSpilled(buf) ((buf)->spill_fd != -1)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQBUFFER_H
@@ -0,0 +1,335 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqChannel.h"
+#include "treqRequest.h"
+#include "treqPool.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+// Read-only channel for the response body. The channel reads data
+// from the response buffer of the request, and the write callback adds
+// new chunks to the buffer while the transfer is in progress. When
+// the buffer has too much unread data, the transfer is paused, and
+// it is resumed by the channel when the data is read. Thus, the memory
+// used by the response is limited regardless of its size.
+
+struct treq_ChannelType {
+    Tcl_Channel chan;
+    // The request, or NULL if the request has been destroyed
+    treq_RequestType *req;
+    // The limit of unread data in the buffer
+    Tcl_Size buffer_size;
+    // The position of unread data in the response buffer
+    Tcl_Size read_pos;
+    int is_blocking;
+    int watch_mask;
+    Tcl_TimerToken notify_timer;
+};
+
+static Tcl_DriverClose2Proc treq_ChannelClose2Proc;
+static Tcl_DriverInputProc treq_ChannelInputProc;
+static Tcl_DriverOutputProc treq_ChannelOutputProc;
+static Tcl_DriverWatchProc treq_ChannelWatchProc;
+static Tcl_DriverGetHandleProc treq_ChannelGetHandleProc;
+static Tcl_DriverBlockModeProc treq_ChannelBlockModeProc;
+
+static Tcl_ChannelType treq_ChannelTypeDef = {
+    "trequests",
+    TCL_CHANNEL_VERSION_5,
+    TCL_CLOSE2PROC,
+    treq_ChannelInputProc,
+    treq_ChannelOutputProc,
+    NULL,
+    NULL,
+    NULL,
+    treq_ChannelWatchProc,
+    treq_ChannelGetHandleProc,
+    treq_ChannelClose2Proc,
+    treq_ChannelBlockModeProc,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+static Tcl_Size treq_ChannelGetUnread(treq_ChannelType *ch) {
+    return ch->req->content.size - ch->read_pos;
+}
+
+// The channel is readable when it has data or when the next read
+// returns EOF or an error
+static int treq_ChannelIsReady(treq_ChannelType *ch) {
+    return (ch->req == NULL || treq_ChannelGetUnread(ch) > 0 || treq_RequestIsCompleted(ch->req));
+}
+
+static void treq_ChannelTimerProc(ClientData clientData) {
+    treq_ChannelType *ch = (treq_ChannelType *)clientData;
+    ch->notify_timer = NULL;
+    if (ch->watch_mask & TCL_READABLE) {
+        DBG2(printf("notify channel %p", (void *)ch));
+        Tcl_NotifyChannel(ch->chan, TCL_READABLE);
+    }
+}
+
+// Schedules the readable event if it is watched and the channel is ready.
+// The channel is not notified directly, since this can be called from curl
+// callbacks, where Tcl scripts of channel handlers must not be run.
+void treq_ChannelNotify(treq_ChannelType *ch) {
+    if ((ch->watch_mask & TCL_READABLE) && ch->notify_timer == NULL && treq_ChannelIsReady(ch)) {
+        ch->notify_timer = Tcl_CreateTimerHandler(0, treq_ChannelTimerProc, (ClientData)ch);
+    }
+}
+
+static void treq_ChannelWatchProc(ClientData instanceData, int mask) {
+
+    treq_ChannelType *ch = (treq_ChannelType *)instanceData;
+
+    DBG2(printf("enter; ch: %p mask: %d", (void *)ch, mask));
+
+    ch->watch_mask = mask;
+
+    if (mask & TCL_READABLE) {
+        treq_ChannelNotify(ch);
+    } else if (ch->notify_timer != NULL) {
+        Tcl_DeleteTimerHandler(ch->notify_timer);
+        ch->notify_timer = NULL;
+    }
+
+}
+
+static int treq_ChannelInputProc(ClientData instanceData, char *buf, int toRead, int *errorCodePtr) {
+
+    treq_ChannelType *ch = (treq_ChannelType *)instanceData;
+
+    DBG2(printf("enter; ch: %p to read: %d", (void *)ch, toRead));
+
+    for (;;) {
+
+        treq_RequestType *req = ch->req;
+
+        if (req == NULL) {
+            DBG2(printf("return: ERROR (the request has been destroyed)"));
+            *errorCodePtr = EPIPE;
+            return -1;
+        }
+
+        Tcl_Size unread = treq_ChannelGetUnread(ch);
+
+        if (unread > 0) {
+
+            int count = (unread < toRead ? (int)unread : toRead);
+            const char *data = treq_BufferGetData(&req->content);
+            if (data == NULL) {
+                DBG2(printf("return: ERROR (failed to get the data)"));
+                *errorCodePtr = EIO;
+                return -1;
+            }
+            memcpy(buf, data + ch->read_pos, count);
+            ch->read_pos += count;
+            unread -= count;
+
+            // Start filling the buffer from the beginning when all data
+            // has been read
+            if (unread == 0) {
+                treq_BufferDiscard(&req->content, req->content.size);
+                ch->read_pos = 0;
+            }
+
+            if (req->is_paused && unread < ch->buffer_size) {
+                DBG2(printf("resume the transfer"));
+                treq_RequestResume(req);
+            }
+
+            DBG2(printf("return: %d", count));
+            return count;
+
+        }
+
+        if (treq_RequestIsCompleted(req)) {
+            if (req->state == TREQ_REQUEST_ERROR) {
+                DBG2(printf("return: ERROR (the request is failed)"));
+                *errorCodePtr = EIO;
+                return -1;
+            }
+            DBG2(printf("return: EOF"));
+            return 0;
+        }
+
+        if (!ch->is_blocking || req->pool == NULL) {
+            DBG2(printf("return: EAGAIN"));
+            *errorCodePtr = EAGAIN;
+            return -1;
+        }
+
+        // Drive the pool until new data arrives. Tcl events are not
+        // processed here, so the request cannot be destroyed while
+        // we are waiting.
+        DBG2(printf("wait for data"));
+        req->is_channel_waiting = 1;
+        int rc = treq_PoolWaitRequests(&req, 1, 1, -1);
+        req->is_channel_waiting = 0;
+
+        if (rc < 0) {
+            DBG2(printf("return: EIO"));
+            *errorCodePtr = EIO;
+            return -1;
+        }
+
+    }
+
+}
+
+static int treq_ChannelOutputProc(ClientData instanceData, const char *buf, int toWrite, int *errorCodePtr) {
+    UNUSED(instanceData);
+    UNUSED(buf);
+    UNUSED(toWrite);
+    *errorCodePtr = EINVAL;
+    return -1;
+}
+
+static int treq_ChannelGetHandleProc(ClientData instanceData, int direction, ClientData *handlePtr) {
+    UNUSED(instanceData);
+    UNUSED(direction);
+    UNUSED(handlePtr);
+    return TCL_ERROR;
+}
+
+static int treq_ChannelBlockModeProc(ClientData instanceData, int mode) {
+    treq_ChannelType *ch = (treq_ChannelType *)instanceData;
+    ch->is_blocking = (mode == TCL_MODE_BLOCKING);
+    return 0;
+}
+
+static int treq_ChannelClose2Proc(ClientData instanceData, Tcl_Interp *interp, int flags) {
+
+    UNUSED(interp);
+
+    if ((flags & (TCL_CLOSE_READ | TCL_CLOSE_WRITE)) != 0) {
+        return EINVAL;
+    }
+
+    treq_ChannelType *ch = (treq_ChannelType *)instanceData;
+
+    DBG2(printf("enter; ch: %p", (void *)ch));
+
+    if (ch->notify_timer != NULL) {
+        Tcl_DeleteTimerHandler(ch->notify_timer);
+    }
+
+    treq_RequestType *req = ch->req;
+
+    if (req != NULL) {
+
+        req->channel = NULL;
+        req->is_channel_closed = 1;
+
+        // Nobody will read the rest of the response. Drop the unread data
+        // and let the write callback abort the transfer.
+        treq_BufferDiscard(&req->content, req->content.size);
+        if (req->is_paused) {
+            treq_RequestResume(req);
+        }
+
+    }
+
+    ckfree(ch);
+
+    DBG2(printf("return: ok"));
+    return 0;
+
+}
+
+// Creates the channel for the response body of the request. The channel
+// is not registered in any interp.
+Tcl_Channel treq_ChannelCreate(treq_RequestType *req, Tcl_Size buffer_size) {
+
+    DBG2(printf("enter; req: %p buffer size: %" TCL_SIZE_MODIFIER "d", (void *)req, buffer_size));
+
+    treq_ChannelType *ch = ckalloc(sizeof(treq_ChannelType));
+    memset(ch, 0, sizeof(treq_ChannelType));
+
+    ch->req = req;
+    ch->buffer_size = buffer_size;
+    ch->is_blocking = 1;
+
+    // The channel already limits the memory used by the response, and
+    // the data in a temporary file cannot be compacted
+    if (!treq_BufferIsSpilled(&req->content)) {
+        req->content.spill_threshold = -1;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "trequests%p", (void *)ch);
+    ch->chan = Tcl_CreateChannel(&treq_ChannelTypeDef, name, (ClientData)ch, TCL_READABLE);
+
+    // The response body is binary data by default
+    Tcl_SetChannelOption(NULL, ch->chan, "-translation", "binary");
+
+    req->channel = ch;
+
+    DBG2(printf("return: ok (%s)", name));
+    return ch->chan;
+
+}
+
+Tcl_Channel treq_ChannelGet(treq_ChannelType *ch) {
+    return ch->chan;
+}
+
+// Disconnects the channel from the request that is being destroyed.
+// Subsequent reads from the channel fail.
+void treq_ChannelDetach(treq_ChannelType *ch) {
+    DBG2(printf("enter; ch: %p", (void *)ch));
+    ch->req->channel = NULL;
+    ch->req = NULL;
+    treq_ChannelNotify(ch);
+}
+
+// Adds the chunk to the response buffer. It is called by the write
+// callback. Returns the value for curl: the size of the chunk,
+// CURL_WRITEFUNC_PAUSE if there is too much unread data, or
+// CURL_WRITEFUNC_ERROR on memory allocation error.
+size_t treq_ChannelWrite(treq_ChannelType *ch, const char *ptr, size_t size) {
+
+    treq_RequestType *req = ch->req;
+
+    if (treq_ChannelGetUnread(ch) >= ch->buffer_size) {
+        DBG2(printf("pause the transfer, unread: %" TCL_SIZE_MODIFIER "d", treq_ChannelGetUnread(ch)));
+        req->is_paused = 1;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    // Move unread data to the beginning, so that the buffer doesn't grow
+    // beyond the limit
+    if (ch->read_pos > 0 && treq_BufferDiscard(&req->content, ch->read_pos)) {
+        ch->read_pos = 0;
+    }
+
+    if (!treq_BufferAppend(&req->content, ptr, size)) {
+        return CURL_WRITEFUNC_ERROR;
+    }
+
+    treq_ChannelNotify(ch);
+
+    return size;
+
+}
+
+// Returns true if the channel has unread data
+int treq_ChannelHasData(treq_ChannelType *ch) {
+    return (treq_ChannelGetUnread(ch) > 0);
+}
+
+// Drops the unread data of the failed response, so that the next read
+// returns the error
+void treq_ChannelDiscard(treq_ChannelType *ch) {
+    DBG2(printf("enter; ch: %p unread: %" TCL_SIZE_MODIFIER "d", (void *)ch, treq_ChannelGetUnread(ch)));
+    treq_BufferDiscard(&ch->req->content, ch->req->content.size);
+    ch->read_pos = 0;
+}
@@ -0,0 +1,31 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQCHANNEL_H
+#define TREQUESTS_TREQCHANNEL_H
+
+#include "common.h"
+
+// The default limit of unread data in the response buffer when
+// the response body is read via the channel
+#define TREQ_CHANNEL_BUFFER_SIZE_DEFAULT 65536
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+Tcl_Channel treq_ChannelCreate(treq_RequestType *req, Tcl_Size buffer_size);
+Tcl_Channel treq_ChannelGet(treq_ChannelType *ch);
+void treq_ChannelDetach(treq_ChannelType *ch);
+size_t treq_ChannelWrite(treq_ChannelType *ch, const char *ptr, size_t size);
+int treq_ChannelHasData(treq_ChannelType *ch);
+void treq_ChannelDiscard(treq_ChannelType *ch);
+void treq_ChannelNotify(treq_ChannelType *ch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQCHANNEL_H
@@ -0,0 +1,172 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqEasyCache.h"
+#include "treqRequest.h"
+
+// Per-thread cache of idle curl easy handles. The handles in the cache
+// are already reset and have the baseline options applied, so creating
+// a new request doesn't need to create a new handle and set these options
+// again. Handles can be put to the cache by the thread that owns the request
+// only. Thus, no locking is needed here.
+
+typedef struct ThreadSpecificData {
+
+    int is_initialized;
+
+    CURL **handles;
+    int count;
+    int size;
+
+    Tcl_WideInt hits;
+    Tcl_WideInt misses;
+
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+static ThreadSpecificData *treq_EasyCacheGetTsd(void) {
+
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (!tsdPtr->is_initialized) {
+        tsdPtr->size = TREQ_EASY_CACHE_DEFAULT_SIZE;
+        tsdPtr->is_initialized = 1;
+    }
+
+    return tsdPtr;
+
+}
+
+CURL *treq_EasyCacheGet(void) {
+
+    ThreadSpecificData *tsdPtr = treq_EasyCacheGetTsd();
+
+    if (tsdPtr->count > 0) {
+        tsdPtr->hits++;
+        DBG2(printf("return: hit (%d handles left)", tsdPtr->count - 1));
+        return tsdPtr->handles[--tsdPtr->count];
+    }
+
+    tsdPtr->misses++;
+
+    CURL *curl_easy = curl_easy_init();
+    if (curl_easy != NULL) {
+        treq_RequestSetEasyBaseline(curl_easy);
+    }
+
+    DBG2(printf("return: miss (%p)", (void *)curl_easy));
+    return curl_easy;
+
+}
+
+void treq_EasyCachePut(CURL *curl_easy) {
+
+    ThreadSpecificData *tsdPtr = treq_EasyCacheGetTsd();
+
+    if (tsdPtr->count >= tsdPtr->size) {
+        DBG2(printf("the cache is full, cleanup the handle %p", (void *)curl_easy));
+        curl_easy_cleanup(curl_easy);
+        return;
+    }
+
+    // curl_easy_reset() doesn't detach the handle from a share object, and
+    // the share object can be destroyed while the handle is in the cache.
+    // Also, make sure that cookies from a previous request are not sent
+    // with the next one.
+    curl_easy_setopt(curl_easy, CURLOPT_SHARE, NULL);
+    curl_easy_setopt(curl_easy, CURLOPT_COOKIELIST, "ALL");
+
+    curl_easy_reset(curl_easy);
+    treq_RequestSetEasyBaseline(curl_easy);
+
+    if (tsdPtr->handles == NULL) {
+        tsdPtr->handles = ckalloc(sizeof(CURL *) * tsdPtr->size);
+    }
+
+    tsdPtr->handles[tsdPtr->count++] = curl_easy;
+
+    DBG2(printf("put the handle %p to the cache (%d handles)", (void *)curl_easy, tsdPtr->count));
+
+}
+
+int treq_EasyCacheSetSize(Tcl_Interp *interp, int size) {
+
+    DBG2(printf("enter; size: %d", size));
+
+    if (size < 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("the easy handle cache size is expected"
+            " to be a non-negative integer, but got %d", size));
+        DBG2(printf("return: ERROR (wrong size)"));
+        return TCL_ERROR;
+    }
+
+    ThreadSpecificData *tsdPtr = treq_EasyCacheGetTsd();
+
+    while (tsdPtr->count > size) {
+        curl_easy_cleanup(tsdPtr->handles[--tsdPtr->count]);
+    }
+
+    if (tsdPtr->handles != NULL) {
+        if (size == 0) {
+            ckfree(tsdPtr->handles);
+            tsdPtr->handles = NULL;
+        } else {
+            tsdPtr->handles = ckrealloc(tsdPtr->handles, sizeof(CURL *) * size);
+        }
+    }
+
+    tsdPtr->size = size;
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
+int treq_EasyCacheGetSize(void) {
+    return treq_EasyCacheGetTsd()->size;
+}
+
+Tcl_Obj *treq_EasyCacheGetStats(void) {
+
+    ThreadSpecificData *tsdPtr = treq_EasyCacheGetTsd();
+
+    Tcl_Obj *result = Tcl_NewDictObj();
+
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("easy_cache_hits", -1),
+        Tcl_NewWideIntObj(tsdPtr->hits));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("easy_cache_misses", -1),
+        Tcl_NewWideIntObj(tsdPtr->misses));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("easy_cache_idle", -1),
+        Tcl_NewIntObj(tsdPtr->count));
+
+    return result;
+
+}
+
+void treq_EasyCacheThreadExitProc(void) {
+
+    DBG2(printf("enter..."));
+
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    while (tsdPtr->count > 0) {
+        curl_easy_cleanup(tsdPtr->handles[--tsdPtr->count]);
+    }
+
+    if (tsdPtr->handles != NULL) {
+        ckfree(tsdPtr->handles);
+        tsdPtr->handles = NULL;
+    }
+
+    // Requests can still be released after this moment. Make sure their
+    // handles are not cached anymore.
+    tsdPtr->size = 0;
+    tsdPtr->is_initialized = 1;
+
+    DBG2(printf("return: ok"));
+
+}
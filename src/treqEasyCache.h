@@ -0,0 +1,31 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQEASYCACHE_H
+#define TREQUESTS_TREQEASYCACHE_H
+
+#include "common.h"
+
+// The default maximum number of idle easy handles kept by each thread
+#define TREQ_EASY_CACHE_DEFAULT_SIZE 32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+CURL *treq_EasyCacheGet(void);
+void treq_EasyCachePut(CURL *curl_easy);
+
+int treq_EasyCacheSetSize(Tcl_Interp *interp, int size);
+int treq_EasyCacheGetSize(void);
+Tcl_Obj *treq_EasyCacheGetStats(void);
+
+void treq_EasyCacheThreadExitProc(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQEASYCACHE_H
@@ -0,0 +1,200 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqHostLimit.h"
+
+// Adaptive concurrency limiter. Each host has its own limit of requests
+// that are served at the same time. The limit is adjusted using the AIMD
+// algorithm: it grows by 1/limit after each successful request when the
+// limit is actually used, and it is multiplied by TREQ_HOST_LIMIT_BACKOFF
+// when a request fails or the smoothed latency exceeds the minimum observed
+// latency by more than TREQ_HOST_LIMIT_TOLERANCE times. The limit is
+// decreased at most once per smoothed RTT, so that a burst of failed
+// requests started at the same time is counted as a single congestion
+// signal.
+
+#define TREQ_HOST_LIMIT_INITIAL 4
+#define TREQ_HOST_LIMIT_BACKOFF 0.9
+#define TREQ_HOST_LIMIT_TOLERANCE 2.0
+// Latency growth in microseconds that is always tolerated. Without it,
+// scheduling jitter would be taken as congestion for very fast backends.
+#define TREQ_HOST_LIMIT_JITTER 1000.0
+// The weight of a new sample in the smoothed RTT
+#define TREQ_HOST_LIMIT_RTT_ALPHA 0.125
+// The minimum RTT is reset after this number of samples, so that
+// the limiter can follow a backend whose latency has changed
+#define TREQ_HOST_LIMIT_RTT_MIN_WINDOW 256
+
+typedef struct treq_HostLimitHostType {
+    double limit;
+    int in_flight;
+    // Smoothed and minimum RTT in microseconds, or 0 if there are no
+    // successful requests yet
+    double rtt;
+    double rtt_min;
+    Tcl_WideInt rtt_min_samples;
+    Tcl_WideInt requests;
+    Tcl_WideInt errors;
+    // The time of the last decrease of the limit in microseconds
+    Tcl_WideInt decreased;
+} treq_HostLimitHostType;
+
+struct treq_HostLimitType {
+    int max_limit;
+    Tcl_HashTable hosts;
+};
+
+treq_HostLimitType *treq_HostLimitInit(int max_limit) {
+
+    DBG2(printf("enter; max_limit: %d", max_limit));
+
+    treq_HostLimitType *hl = ckalloc(sizeof(treq_HostLimitType));
+    hl->max_limit = max_limit;
+    Tcl_InitHashTable(&hl->hosts, TCL_STRING_KEYS);
+
+    DBG2(printf("return: ok (%p)", (void *)hl));
+    return hl;
+
+}
+
+void treq_HostLimitFree(treq_HostLimitType *hl) {
+
+    DBG2(printf("enter; hl: %p", (void *)hl));
+
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&hl->hosts, &search);
+        entry != NULL; entry = Tcl_NextHashEntry(&search))
+    {
+        ckfree(Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&hl->hosts);
+
+    ckfree(hl);
+
+    DBG2(printf("return: ok"));
+
+}
+
+static treq_HostLimitHostType *treq_HostLimitGetHost(treq_HostLimitType *hl, const char *host) {
+
+    int is_new;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&hl->hosts, host, &is_new);
+
+    if (!is_new) {
+        return (treq_HostLimitHostType *)Tcl_GetHashValue(entry);
+    }
+
+    DBG2(printf("new host [%s]", host));
+
+    treq_HostLimitHostType *h = ckalloc(sizeof(treq_HostLimitHostType));
+    memset(h, 0, sizeof(treq_HostLimitHostType));
+    h->limit = (hl->max_limit < TREQ_HOST_LIMIT_INITIAL ? hl->max_limit : TREQ_HOST_LIMIT_INITIAL);
+    Tcl_SetHashValue(entry, h);
+
+    return h;
+
+}
+
+// Takes a slot for a request to the host. Returns 0 if the host
+// has reached its current limit.
+int treq_HostLimitAcquire(treq_HostLimitType *hl, const char *host) {
+
+    treq_HostLimitHostType *h = treq_HostLimitGetHost(hl, host);
+
+    if (h->in_flight >= (int)h->limit) {
+        return 0;
+    }
+
+    h->in_flight++;
+    return 1;
+
+}
+
+// Releases the slot of a request to the host. If the request is completed,
+// its total time in microseconds is specified in rtt and the limit of
+// the host is adjusted. For requests that have been cancelled, rtt is -1.
+void treq_HostLimitRelease(treq_HostLimitType *hl, const char *host, Tcl_WideInt rtt, int is_error, Tcl_WideInt now) {
+
+    treq_HostLimitHostType *h = treq_HostLimitGetHost(hl, host);
+
+    // The number of requests in flight when this request was completed,
+    // including this request
+    int in_flight = h->in_flight--;
+
+    if (rtt < 0) {
+        return;
+    }
+
+    h->requests++;
+
+    int is_congested;
+
+    if (is_error) {
+        h->errors++;
+        is_congested = 1;
+    } else {
+        if (h->rtt == 0) {
+            h->rtt = (double)rtt;
+        } else {
+            h->rtt += TREQ_HOST_LIMIT_RTT_ALPHA * ((double)rtt - h->rtt);
+        }
+        if (h->rtt_min == 0 || rtt < h->rtt_min || ++h->rtt_min_samples >= TREQ_HOST_LIMIT_RTT_MIN_WINDOW) {
+            h->rtt_min = (double)rtt;
+            h->rtt_min_samples = 0;
+        }
+        is_congested = (h->rtt > h->rtt_min * TREQ_HOST_LIMIT_TOLERANCE + TREQ_HOST_LIMIT_JITTER);
+    }
+
+    if (is_congested) {
+        if (now - h->decreased >= (Tcl_WideInt)h->rtt) {
+            h->limit *= TREQ_HOST_LIMIT_BACKOFF;
+            if (h->limit < 1) {
+                h->limit = 1;
+            }
+            h->decreased = now;
+            DBG2(printf("decrease the limit for [%s] to %f", host, h->limit));
+        }
+    } else if (in_flight * 2 >= (int)h->limit) {
+        // Increase the limit only if at least half of it is used. Otherwise,
+        // the limit would grow without bound for an application that sends
+        // few requests at a time.
+        h->limit += 1.0 / h->limit;
+        if (h->limit > hl->max_limit) {
+            h->limit = hl->max_limit;
+        }
+    }
+
+}
+
+// Returns a dict with the current limit, the number of requests in flight,
+// smoothed and minimum RTT in milliseconds, and the number of completed and
+// failed requests for each host
+Tcl_Obj *treq_HostLimitGetStats(treq_HostLimitType *hl) {
+
+    Tcl_Obj *result = Tcl_NewDictObj();
+
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&hl->hosts, &search);
+        entry != NULL; entry = Tcl_NextHashEntry(&search))
+    {
+
+        treq_HostLimitHostType *h = (treq_HostLimitHostType *)Tcl_GetHashValue(entry);
+
+        Tcl_Obj *stats = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("limit", -1), Tcl_NewIntObj((int)h->limit));
+        Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("in_flight", -1), Tcl_NewIntObj(h->in_flight));
+        Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("rtt", -1), Tcl_NewDoubleObj(h->rtt / 1000.0));
+        Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("rtt_min", -1), Tcl_NewDoubleObj(h->rtt_min / 1000.0));
+        Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("requests", -1), Tcl_NewWideIntObj(h->requests));
+        Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("errors", -1), Tcl_NewWideIntObj(h->errors));
+
+        Tcl_DictObjPut(NULL, result, Tcl_NewStringObj(Tcl_GetHashKey(&hl->hosts, entry), -1), stats);
+
+    }
+
+    return result;
+
+}
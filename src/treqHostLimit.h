@@ -0,0 +1,26 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQHOSTLIMIT_H
+#define TREQUESTS_TREQHOSTLIMIT_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+treq_HostLimitType *treq_HostLimitInit(int max_limit);
+void treq_HostLimitFree(treq_HostLimitType *hl);
+
+int treq_HostLimitAcquire(treq_HostLimitType *hl, const char *host);
+void treq_HostLimitRelease(treq_HostLimitType *hl, const char *host, Tcl_WideInt rtt, int is_error, Tcl_WideInt now);
+Tcl_Obj *treq_HostLimitGetStats(treq_HostLimitType *hl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQHOSTLIMIT_H
@@ -0,0 +1,340 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqIoThread.h"
+#include "treqRequest.h"
+#include "treqPool.h"
+
+struct treq_IoThreadType {
+
+    Tcl_ThreadId thread_id;
+    CURLM *curl_multi;
+
+    // The mutex protects the command lists, the is_stopping flag
+    // and the io_state field of all requests served by this thread
+    Tcl_Mutex mx;
+    Tcl_Condition cond;
+
+    // Requests that should be added to the multi handle and requests that
+    // should be removed from it. Both lists are linked by io_next.
+    treq_RequestType *pending_add;
+    treq_RequestType *pending_cancel;
+
+    int is_stopping;
+
+    treq_IoQueueType *queue;
+
+    // Number of requests served by this thread. It is used only by
+    // the owner thread to balance the load between I/O threads.
+    int active_count;
+
+};
+
+void treq_IoQueueInit(treq_IoQueueType *queue, Tcl_EventProc *proc, ClientData clientData,
+    CURLM *wakeup_multi)
+{
+    atomic_init(&queue->head, NULL);
+    queue->owner = Tcl_GetCurrentThread();
+    queue->proc = proc;
+    queue->clientData = clientData;
+    queue->wakeup_multi = wakeup_multi;
+}
+
+static void treq_IoQueuePush(treq_IoQueueType *queue, treq_RequestType *req) {
+
+    treq_RequestType *head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    do {
+        req->io_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, req,
+        memory_order_release, memory_order_relaxed));
+
+    // If the queue was not empty, the owner thread has already been
+    // notified and it will get this request as well.
+    if (head != NULL) {
+        return;
+    }
+
+    DBG2(printf("notify the owner thread"));
+
+    treq_IoQueueEvent *event = ckalloc(sizeof(treq_IoQueueEvent));
+    event->header.proc = queue->proc;
+    event->clientData = queue->clientData;
+    Tcl_ThreadQueueEvent(queue->owner, (Tcl_Event *)event, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(queue->owner);
+
+    // If the owner thread is not waiting in curl_multi_poll() right now,
+    // its next call returns immediately, so the wakeup is not lost.
+    if (queue->wakeup_multi != NULL) {
+        curl_multi_wakeup(queue->wakeup_multi);
+    }
+
+}
+
+// Returns all completed requests in the order they were completed
+treq_RequestType *treq_IoQueuePopAll(treq_IoQueueType *queue) {
+
+    treq_RequestType *head = atomic_exchange_explicit(&queue->head, NULL, memory_order_acquire);
+
+    // The queue is a stack, reverse it
+    treq_RequestType *result = NULL;
+    while (head != NULL) {
+        treq_RequestType *next = head->io_next;
+        head->io_next = result;
+        result = head;
+        head = next;
+    }
+
+    return result;
+
+}
+
+static void treq_IoThreadProcessCommands(treq_IoThreadType *thr) {
+
+    Tcl_MutexLock(&thr->mx);
+
+    treq_RequestType *req;
+
+    if (thr->pending_cancel != NULL) {
+
+        while ((req = thr->pending_cancel) != NULL) {
+            thr->pending_cancel = req->io_next;
+            req->io_next = NULL;
+            DBG2(printf("remove request %p", (void *)req));
+            curl_multi_remove_handle(thr->curl_multi, req->curl_easy);
+            req->io_state = TREQ_IO_NONE;
+        }
+
+        // Wake up the owner thread that is waiting for the cancellation
+        Tcl_ConditionNotify(&thr->cond);
+
+    }
+
+    while ((req = thr->pending_add) != NULL) {
+        thr->pending_add = req->io_next;
+        req->io_next = NULL;
+        DBG2(printf("add request %p", (void *)req));
+        if (curl_multi_add_handle(thr->curl_multi, req->curl_easy) == CURLM_OK) {
+            req->io_state = TREQ_IO_RUNNING;
+        } else {
+            req->io_state = TREQ_IO_DONE;
+            req->io_result = CURLE_FAILED_INIT;
+            treq_IoQueuePush(thr->queue, req);
+        }
+    }
+
+    Tcl_MutexUnlock(&thr->mx);
+
+}
+
+static void treq_IoThreadProcessMessages(treq_IoThreadType *thr) {
+
+    CURLMsg *msg;
+    int msgs_left;
+
+    while ((msg = curl_multi_info_read(thr->curl_multi, &msgs_left)) != NULL) {
+
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        treq_RequestType *req;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &req);
+
+        CURLcode result = msg->data.result;
+        curl_multi_remove_handle(thr->curl_multi, req->curl_easy);
+
+        Tcl_MutexLock(&thr->mx);
+        // If the owner thread is already cancelling this request, it is
+        // in the cancel list. We must not push it to the completion queue.
+        // It will be processed as a cancelled request.
+        if (req->io_state == TREQ_IO_RUNNING) {
+            DBG2(printf("request %p is done", (void *)req));
+            req->io_state = TREQ_IO_DONE;
+            req->io_result = result;
+            treq_IoQueuePush(thr->queue, req);
+        }
+        Tcl_MutexUnlock(&thr->mx);
+
+    }
+
+}
+
+static Tcl_ThreadCreateType treq_IoThreadMain(ClientData clientData) {
+
+    treq_IoThreadType *thr = (treq_IoThreadType *)clientData;
+
+    DBG2(printf("I/O thread started; tid: %p", (void *)Tcl_GetCurrentThread()));
+
+    for (;;) {
+
+        Tcl_MutexLock(&thr->mx);
+        int is_stopping = thr->is_stopping;
+        Tcl_MutexUnlock(&thr->mx);
+
+        if (is_stopping) {
+            break;
+        }
+
+        treq_IoThreadProcessCommands(thr);
+
+        int running_handles;
+        if (curl_multi_perform(thr->curl_multi, &running_handles) != CURLM_OK) {
+            DBG2(printf("ERROR: curl_multi_perform failed"));
+        }
+
+        treq_IoThreadProcessMessages(thr);
+
+        // Wait for network activity, curl timeouts or a wakeup from
+        // the owner thread. The timeout here is only a safety net.
+        curl_multi_poll(thr->curl_multi, NULL, 0, 1000, NULL);
+
+    }
+
+    DBG2(printf("I/O thread stopped; tid: %p", (void *)Tcl_GetCurrentThread()));
+
+    Tcl_ExitThread(TCL_OK);
+    TCL_THREAD_CREATE_RETURN;
+
+}
+
+treq_IoThreadType *treq_IoThreadInit(treq_IoQueueType *queue, const treq_PoolOptionsType *options) {
+
+    DBG2(printf("enter..."));
+
+    treq_IoThreadType *thr = ckalloc(sizeof(treq_IoThreadType));
+    memset(thr, 0, sizeof(treq_IoThreadType));
+
+    thr->queue = queue;
+
+    thr->curl_multi = curl_multi_init();
+    if (thr->curl_multi == NULL) {
+        goto error;
+    }
+
+    // Each I/O thread has its own multi handle, so the pool limits
+    // are applied per I/O thread
+    treq_PoolMultiSetOptions(thr->curl_multi, options);
+
+    if (Tcl_CreateThread(&thr->thread_id, treq_IoThreadMain, (ClientData)thr,
+        TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK)
+    {
+        curl_multi_cleanup(thr->curl_multi);
+        goto error;
+    }
+
+    DBG2(printf("return: ok (%p)", (void *)thr));
+    return thr;
+
+error:
+    ckfree(thr);
+    DBG2(printf("return: ERROR"));
+    return NULL;
+
+}
+
+// The owner thread must remove all requests from the I/O thread before
+// calling this function.
+void treq_IoThreadFree(treq_IoThreadType *thr) {
+
+    DBG2(printf("enter; thr: %p", (void *)thr));
+
+    Tcl_MutexLock(&thr->mx);
+    thr->is_stopping = 1;
+    Tcl_MutexUnlock(&thr->mx);
+
+    curl_multi_wakeup(thr->curl_multi);
+
+    int result;
+    Tcl_JoinThread(thr->thread_id, &result);
+
+    curl_multi_cleanup(thr->curl_multi);
+
+    Tcl_ConditionFinalize(&thr->cond);
+    Tcl_MutexFinalize(&thr->mx);
+
+    ckfree(thr);
+
+    DBG2(printf("return: ok"));
+
+}
+
+void treq_IoThreadAddRequest(treq_IoThreadType *thr, treq_RequestType *req) {
+
+    DBG2(printf("enter; thr: %p req: %p", (void *)thr, (void *)req));
+
+    req->io_thread = thr;
+    thr->active_count++;
+
+    Tcl_MutexLock(&thr->mx);
+    req->io_state = TREQ_IO_PENDING;
+    req->io_next = thr->pending_add;
+    thr->pending_add = req;
+    Tcl_MutexUnlock(&thr->mx);
+
+    curl_multi_wakeup(thr->curl_multi);
+
+    DBG2(printf("return: ok"));
+
+}
+
+// This function removes the request from the I/O thread and waits until
+// the I/O thread releases the request. It returns 1 if the transfer has
+// already been completed. In this case, the request is in the completion
+// queue and the caller must make sure it is not used from there.
+int treq_IoThreadRemoveRequest(treq_IoThreadType *thr, treq_RequestType *req) {
+
+    DBG2(printf("enter; thr: %p req: %p", (void *)thr, (void *)req));
+
+    int is_completed = 0;
+
+    Tcl_MutexLock(&thr->mx);
+
+    switch ((treq_IoStateType)req->io_state) {
+    case TREQ_IO_PENDING:
+        DBG2(printf("the request has not been added yet"));
+        for (treq_RequestType **ptr = &thr->pending_add; *ptr != NULL; ptr = &(*ptr)->io_next) {
+            if (*ptr == req) {
+                *ptr = req->io_next;
+                break;
+            }
+        }
+        req->io_next = NULL;
+        break;
+    case TREQ_IO_RUNNING:
+        DBG2(printf("ask the I/O thread to remove the request"));
+        req->io_state = TREQ_IO_CANCEL;
+        req->io_next = thr->pending_cancel;
+        thr->pending_cancel = req;
+        curl_multi_wakeup(thr->curl_multi);
+        while (req->io_state == TREQ_IO_CANCEL) {
+            Tcl_ConditionWait(&thr->cond, &thr->mx, NULL);
+        }
+        break;
+    case TREQ_IO_DONE:
+        DBG2(printf("the request is already completed"));
+        is_completed = 1;
+        break;
+    case TREQ_IO_CANCEL:
+    case TREQ_IO_NONE:
+        break;
+    }
+
+    req->io_state = TREQ_IO_NONE;
+
+    Tcl_MutexUnlock(&thr->mx);
+
+    req->io_thread = NULL;
+    thr->active_count--;
+
+    DBG2(printf("return: ok (%s)", (is_completed ? "completed" : "removed")));
+    return is_completed;
+
+}
+
+int treq_IoThreadGetActiveCount(treq_IoThreadType *thr) {
+    return thr->active_count;
+}
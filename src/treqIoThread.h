@@ -0,0 +1,65 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQIOTHREAD_H
+#define TREQUESTS_TREQIOTHREAD_H
+
+#include "common.h"
+#include "treqPool.h"
+#include <stdatomic.h>
+
+// States of a request served by an I/O thread. The transitions are
+// protected by the I/O thread mutex.
+typedef enum {
+    // The request is not served by an I/O thread
+    TREQ_IO_NONE,
+    // The request is waiting to be added to the I/O thread multi handle
+    TREQ_IO_PENDING,
+    // The request is in the I/O thread multi handle
+    TREQ_IO_RUNNING,
+    // The owner thread asked the I/O thread to remove the request
+    TREQ_IO_CANCEL,
+    // The transfer is finished and the request is in the completion queue
+    TREQ_IO_DONE
+} treq_IoStateType;
+
+// Lock-free multi-producer single-consumer queue of completed requests.
+// I/O threads push requests, and the thread that owns the queue pops all
+// of them at once. When a push makes the queue non-empty, an event with
+// the specified proc is queued to the owner thread. Also, the wakeup multi
+// handle is woken up so that the owner thread can wait for completed
+// requests with curl_multi_poll() outside of the Tcl event loop.
+typedef struct treq_IoQueueType {
+    _Atomic(treq_RequestType *) head;
+    Tcl_ThreadId owner;
+    Tcl_EventProc *proc;
+    ClientData clientData;
+    CURLM *wakeup_multi;
+} treq_IoQueueType;
+
+typedef struct treq_IoQueueEvent {
+    Tcl_Event header;
+    ClientData clientData;
+} treq_IoQueueEvent;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void treq_IoQueueInit(treq_IoQueueType *queue, Tcl_EventProc *proc, ClientData clientData,
+    CURLM *wakeup_multi);
+treq_RequestType *treq_IoQueuePopAll(treq_IoQueueType *queue);
+
+treq_IoThreadType *treq_IoThreadInit(treq_IoQueueType *queue, const treq_PoolOptionsType *options);
+void treq_IoThreadFree(treq_IoThreadType *thr);
+void treq_IoThreadAddRequest(treq_IoThreadType *thr, treq_RequestType *req);
+int treq_IoThreadRemoveRequest(treq_IoThreadType *thr, treq_RequestType *req);
+int treq_IoThreadGetActiveCount(treq_IoThreadType *thr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQIOTHREAD_H
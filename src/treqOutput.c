@@ -0,0 +1,220 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqOutput.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+// The number of attempts to find a unique name for the temporary file
+#define TREQ_OUTPUT_TEMP_ATTEMPTS 100
+
+treq_OutputType *treq_OutputInit(const char *path, int is_fsync) {
+
+    DBG2(printf("enter; path: [%s] fsync: %d", path, is_fsync));
+
+    treq_OutputType *out = ckalloc(sizeof(treq_OutputType));
+    memset(out, 0, sizeof(treq_OutputType));
+
+    size_t len = strlen(path) + 1;
+    out->path = ckalloc(len);
+    memcpy(out->path, path, len);
+
+    out->fd = -1;
+    out->is_fsync = is_fsync;
+
+    DBG2(printf("return: ok (%p)", (void *)out));
+    return out;
+
+}
+
+void treq_OutputFree(treq_OutputType *out) {
+
+    DBG2(printf("enter; out: %p", (void *)out));
+
+    treq_OutputDiscard(out);
+    ckfree(out->path);
+    ckfree(out);
+
+    DBG2(printf("return: ok"));
+
+}
+
+static void treq_OutputSetError(treq_OutputType *out, const char *op) {
+    if (out->error == 0) {
+        DBG2(printf("failed to %s [%s]: %s", op, out->temp_path, strerror(errno)));
+        out->error = errno;
+        out->error_op = op;
+    }
+}
+
+// Creates the temporary file next to the target file, so that it can
+// be renamed to the target file on the same file system. We don't use
+// mkstemp(), as it creates the file with 0600 permissions instead of
+// the permissions defined by umask.
+Tcl_Obj *treq_OutputOpen(treq_OutputType *out) {
+
+    DBG2(printf("enter; out: %p", (void *)out));
+
+    size_t len = strlen(out->path) + 32;
+    out->temp_path = ckalloc(len);
+
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    unsigned int seed = (unsigned int)getpid() ^ (unsigned int)(uintptr_t)Tcl_GetCurrentThread() ^
+        (unsigned int)now.usec ^ (unsigned int)now.sec;
+
+    for (int i = 0; i < TREQ_OUTPUT_TEMP_ATTEMPTS; i++) {
+        snprintf(out->temp_path, len, "%s.%08x.part", out->path, seed + i * 0x9E3779B9u);
+        out->fd = open(out->temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (out->fd != -1 || errno != EEXIST) {
+            break;
+        }
+    }
+
+    if (out->fd == -1) {
+        Tcl_Obj *error = Tcl_ObjPrintf("failed to create a temporary file for \"%s\": %s",
+            out->path, Tcl_ErrnoMsg(errno));
+        ckfree(out->temp_path);
+        out->temp_path = NULL;
+        DBG2(printf("return: ERROR (%s)", Tcl_GetString(error)));
+        return error;
+    }
+
+    DBG2(printf("return: ok (%s)", out->temp_path));
+    return NULL;
+
+}
+
+// Preallocates disk space for the file of the known size, so that the file
+// is not fragmented and the lack of space is detected before the transfer.
+// Returns 0 if there is not enough space. Other errors are ignored, since
+// not all file systems support preallocation.
+int treq_OutputReserve(treq_OutputType *out, Tcl_WideInt size) {
+
+    DBG2(printf("enter; size: %" TCL_LL_MODIFIER "d", size));
+
+    int rc = posix_fallocate(out->fd, 0, (off_t)size);
+    if (rc == 0) {
+        out->reserved = size;
+    } else if (rc == ENOSPC || rc == EFBIG) {
+        errno = rc;
+        treq_OutputSetError(out, "allocate");
+        DBG2(printf("return: ERROR"));
+        return 0;
+    }
+
+    DBG2(printf("return: ok (%s)", (rc == 0 ? "reserved" : "not supported")));
+    return 1;
+
+}
+
+// Writes the chunk to the file. Returns 0 on error. The error is
+// remembered and reported by treq_OutputCommit().
+int treq_OutputWrite(treq_OutputType *out, const char *ptr, size_t size) {
+
+    while (size > 0) {
+        ssize_t written = write(out->fd, ptr, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            treq_OutputSetError(out, "write");
+            return 0;
+        }
+        ptr += written;
+        size -= (size_t)written;
+        out->size += written;
+    }
+
+    return 1;
+
+}
+
+// Completes the file and renames it to the target file. Returns NULL on
+// success, or an error message. On error, the temporary file is removed.
+Tcl_Obj *treq_OutputCommit(treq_OutputType *out) {
+
+    DBG2(printf("enter; out: %p size: %" TCL_LL_MODIFIER "d", (void *)out, out->size));
+
+    if (out->fd == -1) {
+        DBG2(printf("return: ok (already closed)"));
+        return NULL;
+    }
+
+    // The decoded body can be smaller than the preallocated size, for
+    // example, when the server sends compressed content
+    if (out->reserved > out->size && ftruncate(out->fd, (off_t)out->size) != 0) {
+        treq_OutputSetError(out, "truncate");
+    }
+
+    if (out->is_fsync && out->error == 0 && fsync(out->fd) != 0) {
+        treq_OutputSetError(out, "sync");
+    }
+
+    int fd = out->fd;
+    out->fd = -1;
+    if (close(fd) != 0) {
+        treq_OutputSetError(out, "close");
+    }
+
+    if (out->error == 0 && rename(out->temp_path, out->path) != 0) {
+        treq_OutputSetError(out, "rename");
+    }
+
+    if (out->error != 0) {
+        Tcl_Obj *error = Tcl_ObjPrintf("failed to %s the output file \"%s\": %s",
+            out->error_op, out->path, Tcl_ErrnoMsg(out->error));
+        treq_OutputDiscard(out);
+        DBG2(printf("return: ERROR (%s)", Tcl_GetString(error)));
+        return error;
+    }
+
+    ckfree(out->temp_path);
+    out->temp_path = NULL;
+
+    // The new directory entry must also be on disk. A failure here
+    // is not reported, as the file itself is complete.
+    if (out->is_fsync) {
+        const char *slash = strrchr(out->path, '/');
+        Tcl_DString ds;
+        Tcl_DStringInit(&ds);
+        if (slash == NULL) {
+            Tcl_DStringAppend(&ds, ".", 1);
+        } else {
+            Tcl_DStringAppend(&ds, out->path, (slash == out->path ? 1 : slash - out->path));
+        }
+        int dir_fd = open(Tcl_DStringValue(&ds), O_RDONLY | O_CLOEXEC);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        Tcl_DStringFree(&ds);
+    }
+
+    DBG2(printf("return: ok"));
+    return NULL;
+
+}
+
+// Closes and removes the temporary file, if any
+void treq_OutputDiscard(treq_OutputType *out) {
+
+    if (out->fd != -1) {
+        close(out->fd);
+        out->fd = -1;
+    }
+
+    if (out->temp_path != NULL) {
+        DBG2(printf("remove [%s]", out->temp_path));
+        unlink(out->temp_path);
+        ckfree(out->temp_path);
+        out->temp_path = NULL;
+    }
+
+}
@@ -0,0 +1,47 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQOUTPUT_H
+#define TREQUESTS_TREQOUTPUT_H
+
+#include "common.h"
+
+// Output file of a request. The response body is written to a temporary
+// file in the same directory, which replaces the target file only when
+// the transfer is successful. The chunks can be written by an I/O thread,
+// so the write functions don't use any Tcl objects, and errors are
+// reported when the request is completed.
+typedef struct treq_OutputType {
+    char *path;
+    char *temp_path;
+    int fd;
+    int is_fsync;
+    // The number of bytes written to the file
+    Tcl_WideInt size;
+    // The file has been preallocated for the specified number of bytes
+    Tcl_WideInt reserved;
+    // The errno of the failed write operation, and the name of
+    // the operation
+    int error;
+    const char *error_op;
+} treq_OutputType;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+treq_OutputType *treq_OutputInit(const char *path, int is_fsync);
+void treq_OutputFree(treq_OutputType *out);
+Tcl_Obj *treq_OutputOpen(treq_OutputType *out);
+int treq_OutputReserve(treq_OutputType *out, Tcl_WideInt size);
+int treq_OutputWrite(treq_OutputType *out, const char *ptr, size_t size);
+Tcl_Obj *treq_OutputCommit(treq_OutputType *out);
+void treq_OutputDiscard(treq_OutputType *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQOUTPUT_H
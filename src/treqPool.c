@@ -6,28 +6,97 @@
 
 #include "treqPool.h"
 #include "treqRequest.h"
+#include "treqIoThread.h"
+#include "treqRateLimit.h"
+#include "treqHostLimit.h"
+#include "treqChannel.h"
+#include <limits.h>
 
-typedef struct treq_PoolDeactivateEvent {
-    Tcl_Event header;
+typedef struct treq_PoolSocketType {
     treq_PoolType *pool;
-} treq_PoolDeactivateEvent;
+    curl_socket_t sockfd;
+    // Tcl event mask that curl asked us to watch for
+    int mask;
+} treq_PoolSocketType;
 
 struct treq_PoolType {
 
     CURLM *curl_multi;
-
-    treq_LinkedListType *requests;
+    treq_PoolOptionsType options;
+
+    treq_RequestType *requests;
+    int requests_count;
+
+    // Admission control. If options.max_in_flight is set, requests over
+    // the limit wait in this queue. It is a binary heap ordered by
+    // treq_PoolQueueIsBefore(). running_count is the number of requests
+    // that are served by the multi handle or I/O threads.
+    treq_RequestType **queue;
+    Tcl_Size queue_count;
+    Tcl_Size queue_size;
+    Tcl_WideInt queue_seq;
+    int running_count;
+
+    // Rate limiter of the pool. Requests that have a slot in the pool,
+    // but have no tokens from the pool or session rate limiter, wait in
+    // the held list in FIFO order. They are counted in running_count.
+    // held_until is the time in microseconds when the next held request
+    // may get its tokens, or -1 if held requests wait for other requests
+    // to complete.
+    treq_RateLimitType *rate_limit;
+    treq_RequestType *held_head;
+    treq_RequestType *held_tail;
+    int held_count;
+    Tcl_WideInt held_until;
+
+    // Adaptive concurrency limiter for each destination host. Requests
+    // over the limit of their host wait in the held list.
+    treq_HostLimitType *host_limit;
+
+    // The number of bytes in response buffers of transfers in the pool,
+    // and the number of transfers paused because it exceeds
+    // options.memory_budget. Completed requests leave the pool, so their
+    // buffers are not counted.
+    Tcl_WideInt memory_used;
+    int memory_paused_count;
+
+    // The script that is called with the list of handles of requests
+    // completed in the same batch, see treq_RequestEventProc()
+    Tcl_Obj *callback_batch;
+
+    // Tcl file handlers for the sockets that curl asked us to watch,
+    // keyed by the socket descriptor
+    Tcl_HashTable sockets;
+    // Tcl timer that fires when curl wants its timeouts to be handled
+    Tcl_TimerToken timer;
 
     int is_dead;
-    int is_active;
-    int need_refresh;
-    int active_connection_count;
+    // Set when curl may have finished transfers that have not yet been
+    // collected by curl_multi_info_read()
+    int need_check;
+
+    // Off-thread engine. If the pool has I/O threads, transfers are served
+    // by them and completed requests are returned to this thread through
+    // the completion queue.
+    treq_IoThreadType **io_threads;
+    int io_threads_count;
+    treq_IoQueueType io_queue;
 
 };
 
 typedef struct ThreadSpecificData {
 
     treq_PoolType *pool_default;
+    // If true, sync requests are run in the default pool
+    int sync_via_pool;
+    // The number of Tcl scripts that are called by curl in this thread,
+    // see treq_PoolCallbackEnter()
+    int callback_depth;
+    // An empty multi handle that is used by treq_PoolWaitRequests() to wait
+    // for pool sockets. I/O threads wake it up with curl_multi_wakeup() when
+    // they complete requests. It is shared by all pools of this thread.
+    CURLM *wait_multi;
+    int wait_multi_refcount;
 
 } ThreadSpecificData;
 
@@ -35,135 +104,223 @@ static Tcl_ThreadDataKey dataKey;
 
 static Tcl_EventSetupProc treq_PoolEventSetup;
 static Tcl_EventCheckProc treq_PoolEventCheck;
-static Tcl_EventProc treq_PoolDeactivateEventProc;
-static void treq_PoolActivate(treq_PoolType *pool);
-static void treq_PoolDeactivate(treq_PoolType *pool);
-
-static void treq_PoolEventSetup(ClientData clientData, int flags) {
+static Tcl_FileProc treq_PoolSocketEventProc;
+static Tcl_TimerProc treq_PoolTimerEventProc;
+static Tcl_EventProc treq_PoolIoQueueEventProc;
+
+static void treq_PoolAdmitRequests(treq_PoolType *pool);
+static void treq_PoolReleaseHeld(treq_PoolType *pool);
+static void treq_PoolCheckHeld(treq_PoolType *pool);
+static void treq_PoolHostLimitRelease(treq_PoolType *pool, treq_RequestType *req, Tcl_WideInt rtt, int is_error);
+static void treq_PoolMemoryResume(treq_PoolType *pool);
+
+// Returns true if request a should be started before request b. Requests
+// with higher priority go first. Requests with the same priority are
+// started in order of their deadlines, and requests without a deadline
+// go last. Otherwise, the order of submission is kept.
+static inline int treq_PoolQueueIsBefore(treq_RequestType *a, treq_RequestType *b) {
+
+    int a_priority = (a->priority == -1 ? TREQ_REQUEST_PRIORITY_DEFAULT : a->priority);
+    int b_priority = (b->priority == -1 ? TREQ_REQUEST_PRIORITY_DEFAULT : b->priority);
+
+    if (a_priority != b_priority) {
+        return a_priority > b_priority;
+    }
 
-    // Ignore non-file events
-    if (!(flags & TCL_FILE_EVENTS)) {
-        return;
+    if (a->deadline != b->deadline) {
+        if (a->deadline == -1 || b->deadline == -1) {
+            return b->deadline == -1;
+        }
+        return a->deadline < b->deadline;
     }
 
-    treq_PoolType *pool = (treq_PoolType *)clientData;
+    return a->queue_seq < b->queue_seq;
 
-    DBG2(printf("enter..."));
+}
 
-    // This procedure sets the time that the Tcl core is allowed to block
-    // the process from waiting for internal events before it starts
-    // checking other event sources.
-    //
-    // If we just added a new curl handle, we need to update the state
-    // as soon as possible. Therefore, we will set the wait time to 0.
-    //
-    // If we are serving some transfers, instruct the Tcl core not to block
-    // more than 100 milliseconds before checking the curl event source.
-    //
-    // Also, we ask curl if it has any timeouts that need to be handled soon.
-    // If anything, instruct the Tcl core not to wait longer than the required
-    // time before checking the curl event source.
-
-    Tcl_Time time = { 0, 0 };
-
-    if (pool->need_refresh) {
-
-        // Do not set the timeout as it is set to the default value of 0.
-        DBG2(printf("need to update the state as soon as possible"));
-
-        goto done;
-
-    }
-
-    // Ask curl if it has internal timeout values
-    long curl_timeout;
-    if (curl_multi_timeout(pool->curl_multi, &curl_timeout) == CURLM_OK) {
-
-        if (curl_timeout < 0) {
-            DBG2(printf("curl has no internal timeouts"));
-        } else if (curl_timeout < 2) {
-            DBG2(printf("curl wants to update as soon as possible (in %ld millisecond(s))", curl_timeout));
-            pool->need_refresh = 1;
-            goto done;
-        } else if (curl_timeout < 100) {
-            DBG2(printf("curl wants to update in %ld millisecond(s)", curl_timeout));
-            time.usec = curl_timeout * 1000;
-            goto done;
-        } else {
-            DBG2(printf("curl wants to update in %ld millisecond(s), but this value is too high", curl_timeout));
+static inline void treq_PoolQueueSet(treq_PoolType *pool, Tcl_Size index, treq_RequestType *req) {
+    pool->queue[index] = req;
+    req->queue_index = index;
+}
+
+static void treq_PoolQueueSiftUp(treq_PoolType *pool, Tcl_Size index) {
+    treq_RequestType *req = pool->queue[index];
+    while (index > 0) {
+        Tcl_Size parent = (index - 1) / 2;
+        if (!treq_PoolQueueIsBefore(req, pool->queue[parent])) {
+            break;
         }
+        treq_PoolQueueSet(pool, index, pool->queue[parent]);
+        index = parent;
+    }
+    treq_PoolQueueSet(pool, index, req);
+}
+
+static void treq_PoolQueueSiftDown(treq_PoolType *pool, Tcl_Size index) {
+    treq_RequestType *req = pool->queue[index];
+    for (;;) {
+        Tcl_Size child = index * 2 + 1;
+        if (child >= pool->queue_count) {
+            break;
+        }
+        if (child + 1 < pool->queue_count && treq_PoolQueueIsBefore(pool->queue[child + 1], pool->queue[child])) {
+            child++;
+        }
+        if (!treq_PoolQueueIsBefore(pool->queue[child], req)) {
+            break;
+        }
+        treq_PoolQueueSet(pool, index, pool->queue[child]);
+        index = child;
+    }
+    treq_PoolQueueSet(pool, index, req);
+}
+
+static void treq_PoolQueuePush(treq_PoolType *pool, treq_RequestType *req) {
+
+    if (pool->queue_count == pool->queue_size) {
+        pool->queue_size = (pool->queue_size == 0 ? 16 : pool->queue_size * 2);
+        pool->queue = ckrealloc(pool->queue, sizeof(treq_RequestType *) * pool->queue_size);
+    }
+
+    req->queue_seq = pool->queue_seq++;
+    treq_PoolQueueSet(pool, pool->queue_count++, req);
+    treq_PoolQueueSiftUp(pool, req->queue_index);
+
+}
+
+static void treq_PoolQueueRemove(treq_PoolType *pool, treq_RequestType *req) {
+
+    Tcl_Size index = req->queue_index;
+    req->queue_index = -1;
 
+    if (index == --pool->queue_count) {
+        return;
+    }
+
+    // Move the last element to the freed position and restore
+    // the heap property in the direction it is broken
+    treq_PoolQueueSet(pool, index, pool->queue[pool->queue_count]);
+    if (index > 0 && treq_PoolQueueIsBefore(pool->queue[index], pool->queue[(index - 1) / 2])) {
+        treq_PoolQueueSiftUp(pool, index);
     } else {
-        DBG2(printf("ERROR: curl_multi_timeout failed"));
+        treq_PoolQueueSiftDown(pool, index);
+    }
+
+}
+
+static void treq_PoolRequestDone(treq_RequestType *req, CURLcode result) {
+    if (req->is_host_limited) {
+        // Overloaded servers report themselves with these status codes
+        long status_code = 0;
+        curl_off_t total_time = 0;
+        curl_easy_getinfo(req->curl_easy, CURLINFO_RESPONSE_CODE, &status_code);
+        curl_easy_getinfo(req->curl_easy, CURLINFO_TOTAL_TIME_T, &total_time);
+        treq_PoolHostLimitRelease(req->pool, req, (Tcl_WideInt)total_time,
+            (result != CURLE_OK || status_code == 429 || status_code >= 500));
     }
+    treq_RequestComplete(req, result);
+    treq_PoolRemoveRequest(req);
+    treq_RequestScheduleCallback(req);
+}
 
-    DBG2(printf("set Tcl_SetMaxBlockTime() to 100 milliseconds"));
-    time.usec = 100 * 1000;
+// Processes all requests completed by I/O threads. If skip is not NULL,
+// the specified request is not processed. It is used when the request
+// is removed from the pool while it is in the completion queue.
+static void treq_PoolIoQueueProcess(treq_PoolType *pool, treq_RequestType *skip) {
+
+    DBG2(printf("enter; pool: %p", (void *)pool));
+
+    treq_RequestType *req = treq_IoQueuePopAll(&pool->io_queue);
+
+    while (req != NULL) {
+
+        treq_RequestType *next = req->io_next;
+        req->io_next = NULL;
+
+        if (req != skip) {
+            DBG2(printf("request %p completed with %s", (void *)req,
+                (req->io_result == CURLE_OK ? "OK" : "ERROR")));
+            treq_PoolRequestDone(req, req->io_result);
+        }
 
-done:
+        req = next;
 
-    Tcl_SetMaxBlockTime(&time);
+    }
 
     DBG2(printf("return: ok"));
 
 }
 
-static void treq_PoolEventCheck(ClientData clientData, int flags) {
+static int treq_PoolIoQueueEventProc(Tcl_Event *evPtr, int flags) {
 
     // Ignore non-file events
     if (!(flags & TCL_FILE_EVENTS)) {
-        return;
+        return 0;
     }
 
-    treq_PoolType *pool = (treq_PoolType *)clientData;
+    treq_PoolIoQueueProcess((treq_PoolType *)((treq_IoQueueEvent *)evPtr)->clientData, NULL);
+    return 1;
 
-    DBG2(printf("enter..."));
+}
 
-    if (pool->need_refresh) {
-        pool->need_refresh = 0;
-        DBG2(printf("need to update the state as soon as possible"));
-        goto perform;
-    }
-
-    // Actually, we can do curl_multi_perform() right here. In treq_PoolEventSetup(),
-    // we allowed the Tcl core to wait 100ms when waiting for internal events.
-    // However, it is possible that there are other event sources that instruct
-    // Tcl core to process event sources as fast as possible (with zero wait time).
-    // All event sources are handled in a fair discipline, so this event checker
-    // will also run without delay. This may cause busy-loop and significant CPU
-    // usage unnecessarily.
-    //
-    // To avoid this case, we will do poll, but with a minimum wait time
-    // of 1 millisecond. This should not block significantly block other
-    // Tcl events, but it should be enough to avoid a busy loop.
-
-    int numfds;
-    if (curl_multi_wait(pool->curl_multi, NULL, 0, 1, &numfds) != CURLM_OK) {
-        DBG2(printf("ERROR: curl_multi_poll failed"));
+static int treq_PoolIoQueueEventDeleteProc(Tcl_Event *evPtr, ClientData clientData) {
+    return (evPtr->proc == treq_PoolIoQueueEventProc &&
+        ((treq_IoQueueEvent *)evPtr)->clientData == clientData);
+}
+
+static void treq_PoolEventSetup(ClientData clientData, int flags) {
+
+    // Ignore non-file events
+    if (!(flags & TCL_FILE_EVENTS)) {
         return;
     }
 
-    if (numfds == 0) {
-        DBG2(printf("return: ok (no new events)"));
+    treq_PoolType *pool = (treq_PoolType *)clientData;
+
+    // Sockets and timeouts are handled by Tcl file handlers and Tcl timers
+    // created on curl's request. Thus, this event source doesn't need to
+    // limit the time that the Tcl core is allowed to block. The only case
+    // is when curl has done some work and there may be completed transfers.
+    // Then we want to collect them as soon as possible.
+
+    if (pool->need_check) {
+        DBG2(printf("need to check for completed transfers"));
+        Tcl_Time time = { 0, 0 };
+        Tcl_SetMaxBlockTime(&time);
         return;
     }
 
-    DBG2(printf("curl has reported about %d waiting file descriptor(s)", numfds));
+    // Requests held by rate limiters should be started when the next
+    // token is available
+    if (pool->held_head != NULL && pool->held_until != -1) {
+        Tcl_WideInt wait = pool->held_until - treq_RateLimitGetTime();
+        if (wait < 0) {
+            wait = 0;
+        }
+        DBG2(printf("wait for held requests: %" TCL_LL_MODIFIER "d usec", (long long)wait));
+        Tcl_Time time = { (long)(wait / 1000000), (long)(wait % 1000000) };
+        Tcl_SetMaxBlockTime(&time);
+    }
 
-perform:
+}
 
-    if (curl_multi_perform(pool->curl_multi, &numfds) != CURLM_OK) {
-        DBG2(printf("ERROR: curl_multi_perform failed"));
-        return;
+// Starts requests held by rate limiters if it is time to do so
+static void treq_PoolCheckHeld(treq_PoolType *pool) {
+    if (pool->held_head != NULL && pool->held_until != -1 && treq_RateLimitGetTime() >= pool->held_until) {
+        treq_PoolReleaseHeld(pool);
     }
+}
 
-    if (numfds == pool->active_connection_count) {
-        DBG2(printf("we have %d active connection(s) and all of them are in progress", numfds));
+// Collects transfers completed by curl in the local multi handle
+static void treq_PoolCheck(treq_PoolType *pool) {
+
+    if (!pool->need_check) {
         return;
     }
 
-    DBG2(printf("we have %d active connection(s), but curl reported abut %d active connection(s)",
-        pool->active_connection_count, numfds));
+    DBG2(printf("enter..."));
+
+    pool->need_check = 0;
 
     CURLMsg *msg;
     int msgs_left;
@@ -182,53 +339,195 @@ perform:
         DBG2(printf("request %p completed with %s", (void *)request,
             (msg->data.result == CURLE_OK ? "OK" : "ERROR")));
 
-        request->state = (msg->data.result == CURLE_OK ? TREQ_REQUEST_DONE : TREQ_REQUEST_ERROR);
+        treq_PoolRequestDone(request, msg->data.result);
+
+    }
+
+    DBG2(printf("return: ok"));
+
+}
 
-        treq_PoolRemoveRequest(request);
-        treq_RequestScheduleCallback(request);
+static void treq_PoolEventCheck(ClientData clientData, int flags) {
 
+    // Ignore non-file events
+    if (!(flags & TCL_FILE_EVENTS)) {
+        return;
     }
 
-    if (numfds == 0) {
-        DBG2(printf("no more active transfers, queue an event to deactivate curl event source"));
-        // We want to remove the curl event source. But we can not remove it
-        // right now. We are currently in the Tcl_DoOneEvent() procedure,
-        // which iterates through event sources list. Thus, we can not change
-        // this event sources list.
-        treq_PoolDeactivateEvent *event = ckalloc(sizeof(treq_PoolDeactivateEvent));
-        event->header.proc = treq_PoolDeactivateEventProc;
-        event->pool = pool;
-        Tcl_QueueEvent((Tcl_Event *)event, TCL_QUEUE_HEAD);
+    treq_PoolType *pool = (treq_PoolType *)clientData;
+
+    treq_PoolCheck(pool);
+    treq_PoolCheckHeld(pool);
+
+}
+
+static void treq_PoolSocketAction(treq_PoolType *pool, curl_socket_t sockfd, int ev_bitmask) {
+
+    int running_handles;
+    if (curl_multi_socket_action(pool->curl_multi, sockfd, ev_bitmask, &running_handles) != CURLM_OK) {
+        DBG2(printf("ERROR: curl_multi_socket_action failed"));
     }
 
-    DBG2(printf("return: ok"));
+    DBG2(printf("curl has %d running transfer(s)", running_handles));
+
+    // We don't read curl messages here. We only mark the pool, and
+    // the completed transfers will be collected by the event source.
+    pool->need_check = 1;
 
 }
 
-static int treq_PoolDeactivateEventProc(Tcl_Event *evPtr, int flags) {
-    UNUSED(flags);
-    treq_PoolType *pool = ((treq_PoolDeactivateEvent *)evPtr)->pool;
-    DBG2(printf("enter; pool: %p", (void *)pool));
-    treq_PoolDeactivate(pool);
+static void treq_PoolSocketEventProc(ClientData clientData, int mask) {
+
+    treq_PoolSocketType *sock = (treq_PoolSocketType *)clientData;
+
+    DBG2(printf("enter; socket: %d mask: %d", (int)sock->sockfd, mask));
+
+    int ev_bitmask = 0;
+    if (mask & TCL_READABLE) {
+        ev_bitmask |= CURL_CSELECT_IN;
+    }
+    if (mask & TCL_WRITABLE) {
+        ev_bitmask |= CURL_CSELECT_OUT;
+    }
+    if (mask & TCL_EXCEPTION) {
+        ev_bitmask |= CURL_CSELECT_ERR;
+    }
+
+    // Note: the sock structure can be released by curl_multi_socket_action()
+    // if curl decides to stop watching the socket. Don't use it after
+    // the call.
+    treq_PoolSocketAction(sock->pool, sock->sockfd, ev_bitmask);
+
     DBG2(printf("return: ok"));
-    return 1;
+
 }
 
-static void treq_PoolActivate(treq_PoolType *pool) {
+static void treq_PoolTimerEventProc(ClientData clientData) {
+
+    treq_PoolType *pool = (treq_PoolType *)clientData;
+
     DBG2(printf("enter; pool: %p", (void *)pool));
-    pool->is_active = 1;
-    Tcl_CreateEventSource(treq_PoolEventSetup, treq_PoolEventCheck, (ClientData *)pool);
+
+    pool->timer = NULL;
+    treq_PoolSocketAction(pool, CURL_SOCKET_TIMEOUT, 0);
+
     DBG2(printf("return: ok"));
+
 }
 
-static void treq_PoolDeactivate(treq_PoolType *pool) {
-    DBG2(printf("enter; pool: %p", (void *)pool));
-    pool->is_active = 0;
-    Tcl_DeleteEventSource(treq_PoolEventSetup, treq_PoolEventCheck, (ClientData *)pool);
+static void treq_PoolSocketFree(treq_PoolType *pool, Tcl_HashEntry *entry) {
+    treq_PoolSocketType *sock = (treq_PoolSocketType *)Tcl_GetHashValue(entry);
+    DBG2(printf("stop watching socket: %d", (int)sock->sockfd));
+    Tcl_DeleteFileHandler(sock->sockfd);
+    Tcl_DeleteHashEntry(entry);
+    ckfree(sock);
+    UNUSED(pool);
+}
+
+static int treq_PoolSocketCallback(CURL *easy, curl_socket_t sockfd, int what, void *clientp, void *socketp) {
+
+    UNUSED(easy);
+    UNUSED(socketp);
+
+    treq_PoolType *pool = (treq_PoolType *)clientp;
+
+    DBG2(printf("enter; socket: %d what: %d", (int)sockfd, what));
+
+    Tcl_HashEntry *entry;
+
+    if (what == CURL_POLL_REMOVE) {
+        entry = Tcl_FindHashEntry(&pool->sockets, INT2PTR(sockfd));
+        if (entry != NULL) {
+            treq_PoolSocketFree(pool, entry);
+        }
+        DBG2(printf("return: ok (removed)"));
+        return 0;
+    }
+
+    int is_new;
+    entry = Tcl_CreateHashEntry(&pool->sockets, INT2PTR(sockfd), &is_new);
+
+    treq_PoolSocketType *sock;
+    if (is_new) {
+        sock = ckalloc(sizeof(treq_PoolSocketType));
+        sock->pool = pool;
+        sock->sockfd = sockfd;
+        Tcl_SetHashValue(entry, sock);
+    } else {
+        sock = (treq_PoolSocketType *)Tcl_GetHashValue(entry);
+    }
+
+    int mask = 0;
+    if (what & CURL_POLL_IN) {
+        mask |= TCL_READABLE;
+    }
+    if (what & CURL_POLL_OUT) {
+        mask |= TCL_WRITABLE;
+    }
+
+    sock->mask = mask;
+
+    // Tcl_CreateFileHandler() replaces the existing handler for the same
+    // socket, so we can use it both to add a new socket and to change
+    // the event mask for an existing socket.
+    Tcl_CreateFileHandler(sockfd, mask, treq_PoolSocketEventProc, (ClientData)sock);
+
+    DBG2(printf("return: ok (mask: %d)", mask));
+    return 0;
+
+}
+
+static int treq_PoolTimerCallback(CURLM *multi, long timeout_ms, void *clientp) {
+
+    UNUSED(multi);
+
+    treq_PoolType *pool = (treq_PoolType *)clientp;
+
+    DBG2(printf("enter; timeout: %ld", timeout_ms));
+
+    if (pool->timer != NULL) {
+        Tcl_DeleteTimerHandler(pool->timer);
+        pool->timer = NULL;
+    }
+
+    // A timeout value of -1 means that curl wants to delete the timer.
+    // Otherwise, we should call curl_multi_socket_action() when the timeout
+    // expires. We must not call it right here from within the callback,
+    // even if the timeout is 0. Thus, a Tcl timer is always used.
+    if (timeout_ms >= 0) {
+        pool->timer = Tcl_CreateTimerHandler((int)timeout_ms, treq_PoolTimerEventProc, (ClientData)pool);
+    }
+
     DBG2(printf("return: ok"));
+    return 0;
+
 }
 
-static treq_PoolType *treq_PoolInit(void) {
+void treq_PoolMultiSetOptions(CURLM *multi, const treq_PoolOptionsType *options) {
+
+    if (options->max_total_connections != -1) {
+        DBG2(printf("set max total connections: %ld", options->max_total_connections));
+        curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, options->max_total_connections);
+    }
+
+    if (options->max_host_connections != -1) {
+        DBG2(printf("set max host connections: %ld", options->max_host_connections));
+        curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, options->max_host_connections);
+    }
+
+    if (options->max_connects != -1) {
+        DBG2(printf("set max connects: %ld", options->max_connects));
+        curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, options->max_connects);
+    }
+
+    if (options->multiplex != -1) {
+        DBG2(printf("set multiplex: %s", (options->multiplex ? "true" : "false")));
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, (options->multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING));
+    }
+
+}
+
+treq_PoolType *treq_PoolInit(const treq_PoolOptionsType *options) {
 
     DBG2(printf("enter..."));
 
@@ -242,45 +541,512 @@ static treq_PoolType *treq_PoolInit(void) {
         return NULL;
     }
 
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    if (tsdPtr->wait_multi_refcount == 0) {
+        DBG2(printf("create wait multi handle"));
+        tsdPtr->wait_multi = curl_multi_init();
+        if (tsdPtr->wait_multi == NULL) {
+            curl_multi_cleanup(pool->curl_multi);
+            ckfree(pool);
+            DBG2(printf("return: ERROR (could not create a wait multi handle)"));
+            return NULL;
+        }
+    }
+    tsdPtr->wait_multi_refcount++;
+
+    curl_multi_setopt(pool->curl_multi, CURLMOPT_SOCKETFUNCTION, treq_PoolSocketCallback);
+    curl_multi_setopt(pool->curl_multi, CURLMOPT_SOCKETDATA, (void *)pool);
+    curl_multi_setopt(pool->curl_multi, CURLMOPT_TIMERFUNCTION, treq_PoolTimerCallback);
+    curl_multi_setopt(pool->curl_multi, CURLMOPT_TIMERDATA, (void *)pool);
+
+    // The options are saved because they should also be applied to
+    // multi handles of I/O threads
+    if (options == NULL) {
+        treq_PoolOptionsType options_default = treq_InitPoolOptions();
+        pool->options = options_default;
+    } else {
+        pool->options = *options;
+    }
+
+    treq_PoolMultiSetOptions(pool->curl_multi, &pool->options);
+
+    if (pool->options.adaptive_limit != -1) {
+        pool->host_limit = treq_HostLimitInit(pool->options.adaptive_limit);
+    }
+
+    Tcl_InitHashTable(&pool->sockets, TCL_ONE_WORD_KEYS);
+
+    treq_IoQueueInit(&pool->io_queue, treq_PoolIoQueueEventProc, (ClientData)pool,
+        tsdPtr->wait_multi);
+
+    // The event source lives as long as the pool. It costs nothing when
+    // the pool has no completed transfers.
+    Tcl_CreateEventSource(treq_PoolEventSetup, treq_PoolEventCheck, (ClientData)pool);
+
     DBG2(printf("return: ok (%p)", (void *)pool));
     return pool;
 
 }
 
-int treq_PoolAddRequest(treq_RequestType *req) {
+static treq_PoolType *treq_PoolGetDefault(void) {
 
-    DBG2(printf("enter..."));
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (tsdPtr->pool_default == NULL) {
+        DBG2(printf("create default pool"));
+        tsdPtr->pool_default = treq_PoolInit(NULL);
+    }
+
+    return tsdPtr->pool_default;
+
+}
+
+static void treq_PoolIoThreadsFree(treq_PoolType *pool) {
+
+    DBG2(printf("enter; pool: %p", (void *)pool));
+
+    for (int i = 0; i < pool->io_threads_count; i++) {
+        treq_IoThreadFree(pool->io_threads[i]);
+    }
+
+    if (pool->io_threads != NULL) {
+        ckfree(pool->io_threads);
+        pool->io_threads = NULL;
+    }
+
+    pool->io_threads_count = 0;
+
+    // I/O threads are stopped and they can't add new requests to the queue.
+    // Make sure we don't have pending events that refer to this pool.
+    Tcl_DeleteEvents(treq_PoolIoQueueEventDeleteProc, (ClientData)pool);
+
+    DBG2(printf("return: ok"));
+
+}
+
+int treq_PoolSetIoThreads(Tcl_Interp *interp, treq_PoolType *pool, int count) {
 
+    DBG2(printf("enter; pool: %p count: %d", (void *)pool, count));
+
+    if (count < 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("the number of I/O threads is expected"
+            " to be a non-negative integer, but got %d", count));
+        DBG2(printf("return: ERROR (wrong count)"));
+        return TCL_ERROR;
+    }
+
+    if (count == pool->io_threads_count) {
+        DBG2(printf("return: ok (nothing changed)"));
+        return TCL_OK;
+    }
+
+    for (int i = 0; i < pool->io_threads_count; i++) {
+        if (treq_IoThreadGetActiveCount(pool->io_threads[i]) != 0) {
+            SetResult("unable to change the number of I/O threads while"
+                " the pool has active requests");
+            DBG2(printf("return: ERROR (pool is busy)"));
+            return TCL_ERROR;
+        }
+    }
+
+    treq_PoolIoThreadsFree(pool);
+
+    if (count == 0) {
+        DBG2(printf("return: ok (I/O threads are disabled)"));
+        return TCL_OK;
+    }
+
+    pool->io_threads = ckalloc(sizeof(treq_IoThreadType *) * count);
+
+    for (int i = 0; i < count; i++) {
+        if ((pool->io_threads[i] = treq_IoThreadInit(&pool->io_queue, &pool->options)) == NULL) {
+            SetResult("failed to create an I/O thread");
+            treq_PoolIoThreadsFree(pool);
+            DBG2(printf("return: ERROR (failed to create an I/O thread)"));
+            return TCL_ERROR;
+        }
+        pool->io_threads_count++;
+    }
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
+int treq_PoolGetIoThreads(treq_PoolType *pool) {
+    return pool->io_threads_count;
+}
+
+int treq_PoolDefaultSetIoThreads(Tcl_Interp *interp, int count) {
+    treq_PoolType *pool = treq_PoolGetDefault();
+    if (pool == NULL) {
+        SetResult("failed to create a pool");
+        return TCL_ERROR;
+    }
+    return treq_PoolSetIoThreads(interp, pool, count);
+}
+
+int treq_PoolDefaultGetIoThreads(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    return (tsdPtr->pool_default == NULL ? 0 : treq_PoolGetIoThreads(tsdPtr->pool_default));
+}
+
+int treq_PoolDefaultSetMaxInFlight(Tcl_Interp *interp, int max_in_flight) {
+
+    if (max_in_flight < -1 || max_in_flight == 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as positive integer"
+            " value or -1, but got %d", "-max_in_flight", max_in_flight));
+        return TCL_ERROR;
+    }
+
+    treq_PoolType *pool = treq_PoolGetDefault();
+    if (pool == NULL) {
+        SetResult("failed to create a pool");
+        return TCL_ERROR;
+    }
+
+    pool->options.max_in_flight = max_in_flight;
+    // The limit could be increased, start the queued requests
+    treq_PoolAdmitRequests(pool);
+
+    return TCL_OK;
+
+}
+
+int treq_PoolDefaultGetMaxInFlight(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    return (tsdPtr->pool_default == NULL ? -1 : tsdPtr->pool_default->options.max_in_flight);
+}
+
+void treq_PoolDefaultSetSyncViaPool(int enabled) {
     ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    tsdPtr->sync_via_pool = enabled;
+}
 
-    treq_PoolType *pool;
+int treq_PoolDefaultGetSyncViaPool(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    return tsdPtr->sync_via_pool;
+}
 
-    if (tsdPtr->pool_default == NULL) {
-        pool = treq_PoolInit();
-        if (pool == NULL) {
-            DBG2(printf("return: ERROR (failed to create a pool)"));
+// Tcl scripts of -on_data, -on_headers and -callback_debug are called
+// by curl, or by the pool when it completes a request, while
+// it is processing the transfers of a multi handle or curl_easy_perform().
+// Requests, pools and sessions cannot be destroyed from these scripts,
+// as curl and our loops still use their handles after the script
+// returns.
+void treq_PoolCallbackEnter(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    tsdPtr->callback_depth++;
+}
+
+void treq_PoolCallbackLeave(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    tsdPtr->callback_depth--;
+}
+
+int treq_PoolIsInCallback(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    return (tsdPtr->callback_depth > 0);
+}
+
+// Runs a sync request in the default pool and waits for it to complete.
+// Unlike curl_easy_perform(), this doesn't stall the async transfers of
+// the pool, and the request can reuse connections of the pool.
+int treq_PoolDefaultRunRequest(treq_RequestType *req) {
+
+    DBG2(printf("enter; req: %p", (void *)req));
+
+    if (treq_PoolAddRequest(NULL, req) != TCL_OK) {
+        DBG2(printf("return: ERROR (failed to add the request to the pool)"));
+        return TCL_ERROR;
+    }
+
+    // If waiting failed, the request would never be completed. Fail it
+    // instead of returning it in progress.
+    if (treq_PoolWaitRequests(&req, 1, 1, -1) < 0 && req->pool != NULL) {
+        treq_PoolRemoveRequest(req);
+        treq_RequestSetError(req, Tcl_NewStringObj("failed to wait for the request", -1));
+    }
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
+// Passes the request to the multi handle or to an I/O thread
+static int treq_PoolStartRequest(treq_PoolType *pool, treq_RequestType *req) {
+
+    DBG2(printf("enter; pool: %p req: %p", (void *)pool, (void *)req));
+
+    if (pool->io_threads_count > 0 && treq_RequestCanUseIoThread(req)) {
+
+        // Use the least loaded I/O thread
+        treq_IoThreadType *thr = pool->io_threads[0];
+        for (int i = 1; i < pool->io_threads_count; i++) {
+            if (treq_IoThreadGetActiveCount(pool->io_threads[i]) < treq_IoThreadGetActiveCount(thr)) {
+                thr = pool->io_threads[i];
+            }
+        }
+
+        DBG2(printf("add the request to the I/O thread %p", (void *)thr));
+        treq_IoThreadAddRequest(thr, req);
+
+    } else {
+
+        DBG2(printf("add the request to the pool"));
+        if (curl_multi_add_handle(pool->curl_multi, req->curl_easy) != CURLM_OK) {
+            DBG2(printf("return: ERROR (failed to add the request to the pool)"));
             return TCL_ERROR;
         }
-        tsdPtr->pool_default = pool;
+
+        // Curl will now call treq_PoolTimerCallback() to schedule the first
+        // action for the new transfer.
+
+    }
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
+// Removes the request that failed to start from the pool
+static void treq_PoolFailRequest(treq_PoolType *pool, treq_RequestType *req) {
+
+    treq_ListRemove(pool->requests, req, pool);
+    pool->requests_count--;
+    req->pool = NULL;
+
+    treq_RequestSetError(req, Tcl_NewStringObj("failed to add the request to the pool", -1));
+    treq_RequestScheduleCallback(req);
+
+}
+
+static void treq_PoolHeldRemove(treq_PoolType *pool, treq_RequestType *req) {
+
+    if (req->held_prev == NULL) {
+        pool->held_head = req->held_next;
     } else {
-        pool = tsdPtr->pool_default;
+        req->held_prev->held_next = req->held_next;
     }
 
-    DBG2(printf("add the request to the pool"));
-    if (curl_multi_add_handle(pool->curl_multi, req->curl_easy) != CURLM_OK) {
-        DBG2(printf("return: ERROR (failed to add the request to the pool)"));
+    if (req->held_next == NULL) {
+        pool->held_tail = req->held_prev;
+    } else {
+        req->held_next->held_prev = req->held_prev;
+    }
+
+    req->held_prev = req->held_next = NULL;
+    req->is_held = 0;
+    pool->held_count--;
+
+}
+
+// Takes tokens for the request from the pool and session rate limiters
+// and a slot from the adaptive limiter of the request host. If any of them
+// is not available, nothing is taken. In this case, the time to wait in
+// microseconds is returned in wait_ptr, or -1 if the request should wait
+// for another request to the same host to complete.
+static int treq_PoolLimitsAcquire(treq_PoolType *pool, treq_RequestType *req, Tcl_WideInt now, Tcl_WideInt *wait_ptr) {
+
+    const char *host = treq_RequestGetHost(req);
+    Tcl_WideInt wait = 0, w;
+
+    if (pool->rate_limit != NULL && (w = treq_RateLimitCheck(pool->rate_limit, host, now)) > wait) {
+        wait = w;
+    }
+    if (req->rate_limit != NULL && (w = treq_RateLimitCheck(req->rate_limit, host, now)) > wait) {
+        wait = w;
+    }
+
+    if (wait > 0) {
+        *wait_ptr = wait;
+        return 0;
+    }
+
+    if (pool->host_limit != NULL) {
+        if (!treq_HostLimitAcquire(pool->host_limit, host)) {
+            *wait_ptr = -1;
+            return 0;
+        }
+        req->is_host_limited = 1;
+    }
+
+    if (pool->rate_limit != NULL) {
+        treq_RateLimitConsume(pool->rate_limit, host);
+    }
+    if (req->rate_limit != NULL) {
+        treq_RateLimitConsume(req->rate_limit, host);
+    }
+
+    return 1;
+
+}
+
+// Releases the slot of the adaptive limiter taken by the request. For
+// completed requests, rtt is the total time of the request in microseconds.
+// Otherwise, it is -1.
+static void treq_PoolHostLimitRelease(treq_PoolType *pool, treq_RequestType *req, Tcl_WideInt rtt, int is_error) {
+    if (req->is_host_limited) {
+        req->is_host_limited = 0;
+        treq_HostLimitRelease(pool->host_limit, treq_RequestGetHost(req), rtt, is_error,
+            treq_RateLimitGetTime());
+    }
+}
+
+static void treq_PoolHeldUpdate(treq_PoolType *pool, Tcl_WideInt now, Tcl_WideInt wait) {
+    if (wait != -1 && (pool->held_until == -1 || now + wait < pool->held_until)) {
+        pool->held_until = now + wait;
+    }
+}
+
+// Starts held requests that can get tokens from rate limiters and slots
+// from the adaptive limiter, and calculates the time when the next held
+// request may be started
+static void treq_PoolReleaseHeld(treq_PoolType *pool) {
+
+    if (pool->held_head == NULL) {
+        return;
+    }
+
+    DBG2(printf("enter; pool: %p held: %d", (void *)pool, pool->held_count));
+
+    Tcl_WideInt now = treq_RateLimitGetTime();
+    pool->held_until = -1;
+
+    treq_RequestType *req = pool->held_head;
+    while (req != NULL) {
+
+        treq_RequestType *next = req->held_next;
+
+        Tcl_WideInt wait;
+        if (treq_PoolLimitsAcquire(pool, req, now, &wait)) {
+            DBG2(printf("release request %p", (void *)req));
+            treq_PoolHeldRemove(pool, req);
+            req->state = TREQ_REQUEST_INPROGRESS;
+            if (treq_PoolStartRequest(pool, req) != TCL_OK) {
+                pool->running_count--;
+                treq_PoolHostLimitRelease(pool, req, -1, 0);
+                treq_PoolFailRequest(pool, req);
+            }
+        } else {
+            treq_PoolHeldUpdate(pool, now, wait);
+        }
+
+        req = next;
+
+    }
+
+    DBG2(printf("return: ok (held: %d)", pool->held_count));
+
+}
+
+// Takes a slot in the pool for the request and starts it, or holds it
+// until the rate limiters and the adaptive limiter allow it to start
+static int treq_PoolDispatchRequest(treq_PoolType *pool, treq_RequestType *req) {
+
+    pool->running_count++;
+
+    if (pool->rate_limit != NULL || req->rate_limit != NULL || pool->host_limit != NULL) {
+
+        // Let the requests that are already waiting go first
+        treq_PoolReleaseHeld(pool);
+
+        Tcl_WideInt now = treq_RateLimitGetTime();
+        Tcl_WideInt wait;
+        if (!treq_PoolLimitsAcquire(pool, req, now, &wait)) {
+
+            DBG2(printf("hold request %p", (void *)req));
+
+            if (pool->held_head == NULL) {
+                pool->held_until = -1;
+            }
+
+            req->held_prev = pool->held_tail;
+            req->held_next = NULL;
+            if (pool->held_tail == NULL) {
+                pool->held_head = req;
+            } else {
+                pool->held_tail->held_next = req;
+            }
+            pool->held_tail = req;
+            req->is_held = 1;
+            pool->held_count++;
+            req->state = TREQ_REQUEST_QUEUED;
+
+            treq_PoolHeldUpdate(pool, now, wait);
+
+            return TCL_OK;
+
+        }
+
+    }
+
+    req->state = TREQ_REQUEST_INPROGRESS;
+    if (treq_PoolStartRequest(pool, req) != TCL_OK) {
+        pool->running_count--;
+        treq_PoolHostLimitRelease(pool, req, -1, 0);
         return TCL_ERROR;
     }
 
-    treq_LinkedListInsertNewItem(pool->requests, req);
-    req->pool = pool;
+    return TCL_OK;
+
+}
+
+// Starts queued requests while the pool has free slots
+static void treq_PoolAdmitRequests(treq_PoolType *pool) {
+
+    while (pool->queue_count > 0 && !pool->is_dead &&
+        (pool->options.max_in_flight == -1 || pool->running_count < pool->options.max_in_flight))
+    {
+
+        treq_RequestType *req = pool->queue[0];
+        treq_PoolQueueRemove(pool, req);
+
+        DBG2(printf("admit request %p", (void *)req));
+
+        if (treq_PoolDispatchRequest(pool, req) != TCL_OK) {
+            treq_PoolFailRequest(pool, req);
+        }
+
+    }
+
+}
+
+int treq_PoolAddRequest(treq_PoolType *pool, treq_RequestType *req) {
+
+    DBG2(printf("enter; pool: %p", (void *)pool));
+
+    if (pool == NULL) {
+        DBG2(printf("use the default pool"));
+        pool = treq_PoolGetDefault();
+        if (pool == NULL) {
+            DBG2(printf("return: ERROR (failed to create a pool)"));
+            return TCL_ERROR;
+        }
+    }
+
+    // The response body can be written by an I/O thread as soon as
+    // the request is dispatched, so the threshold is set here
+    if (req->content.spill_threshold == -1) {
+        req->content.spill_threshold = pool->options.spill_threshold;
+    }
 
-    if (!pool->is_active) {
-        treq_PoolActivate(pool);
+    if (pool->options.max_in_flight != -1 && pool->running_count >= pool->options.max_in_flight) {
+        DBG2(printf("the pool is full, queue the request"));
+        treq_PoolQueuePush(pool, req);
+        req->state = TREQ_REQUEST_QUEUED;
+    } else if (treq_PoolDispatchRequest(pool, req) != TCL_OK) {
+        DBG2(printf("return: ERROR (failed to start the request)"));
+        return TCL_ERROR;
     }
 
-    pool->active_connection_count++;
-    pool->need_refresh = 1;
+    treq_ListInsert(pool->requests, req, pool);
+    if (pool->callback_batch != NULL && req->callback_batch == NULL) {
+        req->callback_batch = pool->callback_batch;
+        Tcl_IncrRefCount(req->callback_batch);
+    }
+    pool->requests_count++;
+    req->pool = pool;
 
     DBG2(printf("return: ok"));
     return TCL_OK;
@@ -293,16 +1059,43 @@ void treq_PoolRemoveRequest(treq_RequestType *req) {
 
     DBG2(printf("enter; pool: %p remove: %p", (void *)pool, (void *)req));
 
-    curl_multi_remove_handle(pool->curl_multi, req->curl_easy);
+    if (req->queue_index != -1) {
+        DBG2(printf("remove the request from the queue"));
+        treq_PoolQueueRemove(pool, req);
+    } else if (req->is_held) {
+        DBG2(printf("remove the request from the held list"));
+        treq_PoolHeldRemove(pool, req);
+        pool->running_count--;
+    } else if (req->io_thread != NULL) {
+        if (treq_IoThreadRemoveRequest(req->io_thread, req) && req->state == TREQ_REQUEST_INPROGRESS) {
+            // The transfer is completed, but the request is still in
+            // the completion queue. Process the completion queue now,
+            // but without this request.
+            DBG2(printf("the request is in the completion queue"));
+            treq_PoolIoQueueProcess(pool, req);
+        }
+        pool->running_count--;
+    } else {
+        curl_multi_remove_handle(pool->curl_multi, req->curl_easy);
+        pool->running_count--;
+    }
 
-    if (!pool->is_dead) {
-        treq_LinkedListRemoveByItem(pool->requests, req);
+    if (req->is_host_limited) {
+        treq_PoolHostLimitRelease(pool, req, -1, 0);
+    }
+
+    pool->memory_used -= req->pool_memory;
+    req->pool_memory = 0;
+    if (req->is_memory_paused) {
+        req->is_memory_paused = 0;
+        pool->memory_paused_count--;
     }
-    req->pool = NULL;
 
-    pool->active_connection_count--;
+    treq_ListRemove(pool->requests, req, pool);
+    pool->requests_count--;
+    req->pool = NULL;
 
-    if (req->state == TREQ_REQUEST_INPROGRESS) {
+    if (!treq_RequestIsCompleted(req)) {
         if (Tcl_InterpDeleted(req->interp)) {
             DBG2(printf("interp is deleted"));
         } else {
@@ -313,11 +1106,325 @@ void treq_PoolRemoveRequest(treq_RequestType *req) {
         }
     }
 
+    // The request released a slot, or the queue has changed
+    if (pool->host_limit != NULL && !pool->is_dead) {
+        treq_PoolReleaseHeld(pool);
+    }
+    treq_PoolAdmitRequests(pool);
+
+    // The request released its memory, or it was the last active transfer
+    if (!pool->is_dead) {
+        treq_PoolMemoryResume(pool);
+    }
+
     DBG2(printf("return: ok"));
 
 }
 
-static void treq_PoolFree(treq_PoolType *pool) {
+// Returns true if all transfers of the pool are paused by the memory
+// budget or wait for rate limiters, except the specified number of them
+static inline int treq_PoolMemoryIsStalled(treq_PoolType *pool, int except) {
+    return (pool->memory_paused_count + pool->held_count + except >= pool->running_count);
+}
+
+// Checks the memory budget before the chunk is added to the response buffer
+// of the request. Returns 0 if the budget is exhausted and the transfer
+// should be paused. The last active transfer of the pool is never paused,
+// otherwise the pool would stall when the buffers of paused transfers
+// exceed the budget.
+int treq_PoolMemoryAcquire(treq_RequestType *req, size_t size) {
+
+    treq_PoolType *pool = req->pool;
+
+    // The chunk of a spilled response doesn't take memory
+    if (pool == NULL || pool->options.memory_budget == -1 || treq_BufferIsSpilled(&req->content)) {
+        return 1;
+    }
+
+    if (pool->memory_used + (Tcl_WideInt)size > pool->options.memory_budget &&
+        !treq_PoolMemoryIsStalled(pool, (req->is_memory_paused ? 0 : 1)))
+    {
+        DBG2(printf("pause the transfer, memory used: %" TCL_LL_MODIFIER "d", pool->memory_used));
+        if (!req->is_memory_paused) {
+            req->is_memory_paused = 1;
+            pool->memory_paused_count++;
+        }
+        req->is_paused = 1;
+        return 0;
+    }
+
+    // The transfer may have been resumed by the resume command
+    if (req->is_memory_paused) {
+        req->is_memory_paused = 0;
+        pool->memory_paused_count--;
+    }
+
+    return 1;
+
+}
+
+// Updates the number of bytes that the response buffer of the request
+// takes in memory
+void treq_PoolMemoryUpdate(treq_RequestType *req) {
+
+    treq_PoolType *pool = req->pool;
+
+    if (pool == NULL || pool->options.memory_budget == -1) {
+        return;
+    }
+
+    Tcl_WideInt used = (treq_BufferIsSpilled(&req->content) ? 0 : req->content.size);
+    pool->memory_used += used - req->pool_memory;
+    req->pool_memory = used;
+
+}
+
+// Resumes transfers paused by the memory budget while the pool has free
+// memory. If all transfers are paused, one of them is resumed anyway.
+static void treq_PoolMemoryResume(treq_PoolType *pool) {
+
+    while (pool->memory_paused_count > 0) {
+
+        if (pool->memory_used >= pool->options.memory_budget && !treq_PoolMemoryIsStalled(pool, 0)) {
+            break;
+        }
+
+        // Resuming the transfer runs the write callback and its Tcl scripts,
+        // which can change the list of requests. Thus, the list is searched
+        // from the head each time instead of keeping the next request.
+        treq_RequestType *req = pool->requests;
+        while (req != NULL && !req->is_memory_paused) {
+            req = req->pool_next;
+        }
+
+        if (req == NULL) {
+            break;
+        }
+
+        DBG2(printf("resume the transfer %p, memory used: %" TCL_LL_MODIFIER "d",
+            (void *)req, pool->memory_used));
+        req->is_memory_paused = 0;
+        pool->memory_paused_count--;
+
+        int paused_count = pool->memory_paused_count;
+        treq_RequestResume(req);
+
+        // The resumed transfer has exhausted the budget again
+        if (pool->memory_paused_count > paused_count) {
+            break;
+        }
+
+    }
+
+}
+
+// Returns the number of milliseconds left before the deadline, or -1
+// if there is no deadline
+static int treq_PoolWaitTimeLeft(const Tcl_Time *deadline) {
+    if (deadline == NULL) {
+        return -1;
+    }
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    long long ms = (long long)(deadline->sec - now.sec) * 1000 + (deadline->usec - now.usec) / 1000;
+    return (ms > 0 ? (int)ms : 0);
+}
+
+// Drives the pools of the specified requests without entering the Tcl event
+// loop until any (or all, if wait_all is true) of the requests is completed,
+// or the timeout expires. Only the sockets and timers of these pools and
+// the completion queues of their I/O threads are serviced, other Tcl events
+// are left for the event loop. Callbacks of the completed requests are
+// scheduled as usual, they are not called from here.
+//
+// Returns 1 if the requests are completed, 0 if the timeout expired and -1
+// if waiting for the sockets failed. A negative timeout value means to wait
+// without a limit.
+int treq_PoolWaitRequests(treq_RequestType **requests, Tcl_Size count, int wait_all, int timeout) {
+
+    DBG2(printf("enter; count: %" TCL_SIZE_MODIFIER "d wait_all: %d timeout: %d",
+        count, wait_all, timeout));
+
+    Tcl_Time deadline_time, *deadline = NULL;
+    if (timeout >= 0) {
+        Tcl_GetTime(&deadline_time);
+        deadline_time.sec += timeout / 1000;
+        deadline_time.usec += (timeout % 1000) * 1000;
+        if (deadline_time.usec >= 1000000) {
+            deadline_time.sec++;
+            deadline_time.usec -= 1000000;
+        }
+        deadline = &deadline_time;
+    }
+
+    // Usually all requests belong to the same pool. Keep the small
+    // array of involved pools on the stack when possible.
+    treq_PoolType *pools_static[8], **pools = pools_static;
+    Tcl_Size pools_size = 8;
+
+    struct curl_waitfd fds_static[32], *fds = fds_static;
+    treq_PoolType *fds_pool_static[32], **fds_pool = fds_pool_static;
+    Tcl_Size fds_size = 32;
+
+    int rc;
+
+    for (;;) {
+
+        Tcl_Size completed = 0;
+        Tcl_Size pools_count = 0;
+
+        for (Tcl_Size i = 0; i < count; i++) {
+            treq_RequestType *req = requests[i];
+            if (treq_RequestIsCompleted(req) || req->pool == NULL ||
+                (req->is_channel_waiting && treq_ChannelHasData(req->channel)))
+            {
+                completed++;
+                continue;
+            }
+            Tcl_Size j;
+            for (j = 0; j < pools_count && pools[j] != req->pool; j++) {}
+            if (j < pools_count) {
+                continue;
+            }
+            if (pools_count == pools_size) {
+                pools_size *= 2;
+                if (pools == pools_static) {
+                    pools = ckalloc(sizeof(treq_PoolType *) * pools_size);
+                    memcpy(pools, pools_static, sizeof(pools_static));
+                } else {
+                    pools = ckrealloc(pools, sizeof(treq_PoolType *) * pools_size);
+                }
+            }
+            pools[pools_count++] = req->pool;
+        }
+
+        if (pools_count == 0 || (!wait_all && completed > 0)) {
+            DBG2(printf("requests are completed"));
+            rc = 1;
+            break;
+        }
+
+        int wait_ms = treq_PoolWaitTimeLeft(deadline);
+        if (wait_ms == 0) {
+            DBG2(printf("timeout expired"));
+            rc = 0;
+            break;
+        }
+
+        // Collect the descriptors of all involved pools and the nearest
+        // curl timeout
+        Tcl_Size fds_count = 0;
+        for (Tcl_Size i = 0; i < pools_count; i++) {
+
+            treq_PoolType *pool = pools[i];
+
+            Tcl_Size need = fds_count + pool->sockets.numEntries;
+            if (need > fds_size) {
+                while (fds_size < need) {
+                    fds_size *= 2;
+                }
+                if (fds == fds_static) {
+                    fds = ckalloc(sizeof(struct curl_waitfd) * fds_size);
+                    fds_pool = ckalloc(sizeof(treq_PoolType *) * fds_size);
+                    memcpy(fds, fds_static, sizeof(fds_static));
+                    memcpy(fds_pool, fds_pool_static, sizeof(fds_pool_static));
+                } else {
+                    fds = ckrealloc(fds, sizeof(struct curl_waitfd) * fds_size);
+                    fds_pool = ckrealloc(fds_pool, sizeof(treq_PoolType *) * fds_size);
+                }
+            }
+
+            Tcl_HashSearch search;
+            for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&pool->sockets, &search);
+                entry != NULL; entry = Tcl_NextHashEntry(&search))
+            {
+                treq_PoolSocketType *sock = (treq_PoolSocketType *)Tcl_GetHashValue(entry);
+                fds[fds_count].fd = sock->sockfd;
+                fds[fds_count].events = ((sock->mask & TCL_READABLE) ? CURL_WAIT_POLLIN : 0) |
+                    ((sock->mask & TCL_WRITABLE) ? CURL_WAIT_POLLOUT : 0);
+                fds[fds_count].revents = 0;
+                fds_pool[fds_count++] = pool;
+            }
+
+            long curl_timeout;
+            if (pool->need_check) {
+                wait_ms = 0;
+            } else if (curl_multi_timeout(pool->curl_multi, &curl_timeout) == CURLM_OK &&
+                curl_timeout >= 0 && (wait_ms < 0 || curl_timeout < wait_ms))
+            {
+                wait_ms = (int)curl_timeout;
+            }
+
+            if (pool->held_head != NULL && pool->held_until != -1) {
+                Tcl_WideInt held_wait = pool->held_until - treq_RateLimitGetTime();
+                // Round up to avoid waking up just before the token is available
+                held_wait = (held_wait > 0 ? (held_wait + 999) / 1000 : 0);
+                if (wait_ms < 0 || held_wait < wait_ms) {
+                    wait_ms = (int)held_wait;
+                }
+            }
+
+        }
+
+        // curl_multi_poll() doesn't accept an infinite timeout. The loop
+        // re-checks the requests anyway, so just wait as long as possible.
+        if (wait_ms < 0) {
+            wait_ms = INT_MAX;
+        }
+
+        // I/O threads wake up this call when they complete requests, the
+        // completion queues are processed below
+        DBG2(printf("poll %" TCL_SIZE_MODIFIER "d descriptor(s) for %d ms", fds_count, wait_ms));
+        ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+        if (curl_multi_poll(tsdPtr->wait_multi, fds, (unsigned int)fds_count, wait_ms, NULL) != CURLM_OK) {
+            DBG2(printf("ERROR: curl_multi_poll failed"));
+            rc = -1;
+            break;
+        }
+
+        for (Tcl_Size i = 0; i < fds_count; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            int ev_bitmask = 0;
+            if (fds[i].revents & (CURL_WAIT_POLLIN | CURL_WAIT_POLLPRI)) {
+                ev_bitmask |= CURL_CSELECT_IN;
+            }
+            if (fds[i].revents & CURL_WAIT_POLLOUT) {
+                ev_bitmask |= CURL_CSELECT_OUT;
+            }
+            treq_PoolSocketAction(fds_pool[i], fds[i].fd, ev_bitmask);
+        }
+
+        for (Tcl_Size i = 0; i < pools_count; i++) {
+            treq_PoolType *pool = pools[i];
+            long curl_timeout;
+            if (curl_multi_timeout(pool->curl_multi, &curl_timeout) == CURLM_OK && curl_timeout == 0) {
+                treq_PoolSocketAction(pool, CURL_SOCKET_TIMEOUT, 0);
+            }
+            treq_PoolCheck(pool);
+            if (pool->io_threads_count > 0) {
+                treq_PoolIoQueueProcess(pool, NULL);
+            }
+            treq_PoolCheckHeld(pool);
+        }
+
+    }
+
+    if (pools != pools_static) {
+        ckfree(pools);
+    }
+    if (fds != fds_static) {
+        ckfree(fds);
+        ckfree(fds_pool);
+    }
+
+    DBG2(printf("return: %s", (rc > 0 ? "completed" : (rc == 0 ? "timeout" : "ERROR"))));
+    return rc;
+
+}
+
+void treq_PoolFree(treq_PoolType *pool) {
 
     DBG2(printf("enter; pool: %p", (void *)pool));
 
@@ -325,19 +1432,105 @@ static void treq_PoolFree(treq_PoolType *pool) {
 
     DBG2(printf("cleanup pool requests"));
 
-    treq_LinkedListFree(pool->requests) {
-        DBG2(printf("cleanup request: %p", (void *)pool->requests->item));
-        treq_PoolRemoveRequest((treq_RequestType *)pool->requests->item);
+    // Removing a request may complete other requests from the completion
+    // queue of I/O threads. Thus, always take the first request from the list.
+    while (pool->requests != NULL) {
+        DBG2(printf("cleanup request: %p", (void *)pool->requests));
+        treq_PoolRemoveRequest(pool->requests);
+    }
+
+    treq_PoolIoThreadsFree(pool);
+
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    if (--tsdPtr->wait_multi_refcount == 0) {
+        DBG2(printf("release wait multi handle"));
+        curl_multi_cleanup(tsdPtr->wait_multi);
+        tsdPtr->wait_multi = NULL;
+    }
+
+    if (pool->queue != NULL) {
+        ckfree(pool->queue);
     }
 
+    if (pool->rate_limit != NULL) {
+        treq_RateLimitDecrRefCount(pool->rate_limit);
+    }
+
+    if (pool->host_limit != NULL) {
+        treq_HostLimitFree(pool->host_limit);
+    }
+
+    Tcl_FreeObject(pool->callback_batch);
+
     curl_multi_cleanup(pool->curl_multi);
 
+    // Release the sockets that curl didn't ask us to remove
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry;
+    while ((entry = Tcl_FirstHashEntry(&pool->sockets, &search)) != NULL) {
+        treq_PoolSocketFree(pool, entry);
+    }
+    Tcl_DeleteHashTable(&pool->sockets);
+
+    if (pool->timer != NULL) {
+        Tcl_DeleteTimerHandler(pool->timer);
+    }
+
+    Tcl_DeleteEventSource(treq_PoolEventSetup, treq_PoolEventCheck, (ClientData)pool);
+
     ckfree(pool);
 
     DBG2(printf("return: ok"));
 
 }
 
+void treq_PoolSetCallbackBatch(treq_PoolType *pool, Tcl_Obj *callback_batch) {
+    Tcl_FreeObject(pool->callback_batch);
+    if (callback_batch != NULL) {
+        pool->callback_batch = callback_batch;
+        Tcl_IncrRefCount(pool->callback_batch);
+    }
+}
+
+// The pool takes ownership of the specified rate limiter reference
+void treq_PoolSetRateLimit(treq_PoolType *pool, treq_RateLimitType *rate_limit) {
+    if (pool->rate_limit != NULL) {
+        treq_RateLimitDecrRefCount(pool->rate_limit);
+    }
+    pool->rate_limit = rate_limit;
+}
+
+Tcl_Obj *treq_PoolGetStats(treq_PoolType *pool) {
+
+    Tcl_Obj *result = Tcl_NewDictObj();
+
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("requests", -1),
+        Tcl_NewIntObj(pool->requests_count));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("sockets", -1),
+        Tcl_NewIntObj(pool->sockets.numEntries));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("io_threads", -1),
+        Tcl_NewIntObj(pool->io_threads_count));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("in_flight", -1),
+        Tcl_NewIntObj(pool->running_count - pool->held_count));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("queued", -1),
+        Tcl_NewWideIntObj(pool->queue_count));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("rate_limited", -1),
+        Tcl_NewIntObj(pool->held_count));
+    if (pool->options.memory_budget != -1) {
+        Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("memory_used", -1),
+            Tcl_NewWideIntObj(pool->memory_used));
+        Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("memory_paused", -1),
+            Tcl_NewIntObj(pool->memory_paused_count));
+    }
+    if (pool->host_limit != NULL) {
+        Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("hosts", -1),
+            treq_HostLimitGetStats(pool->host_limit));
+    }
+
+    return result;
+
+}
+
 void treq_PoolThreadExitProc(void) {
 
     DBG2(printf("enter..."));
@@ -8,13 +8,70 @@
 
 #include "common.h"
 
+// Limits for curl multi handles of a pool. A value of -1 means that
+// the corresponding option is not set and curl's default is used.
+typedef struct treq_PoolOptionsType {
+    long max_total_connections;
+    long max_host_connections;
+    long max_connects;
+    int multiplex;
+    // The maximum number of requests that are served at the same time.
+    // Other requests wait in the pool queue. This option is not related
+    // to curl multi handles.
+    int max_in_flight;
+    // The maximum value of the adaptive concurrency limit for each host,
+    // or -1 if the adaptive limiter is disabled. This option is not
+    // related to curl multi handles.
+    int adaptive_limit;
+    // The size of the response body after which it is moved to
+    // a temporary file, for requests that don't define it
+    int spill_threshold;
+    // The maximum number of bytes buffered by transfers of the pool,
+    // or -1 if there is no limit
+    Tcl_WideInt memory_budget;
+} treq_PoolOptionsType;
+
+#define treq_InitPoolOptions() { \
+    .max_total_connections = -1, \
+    .max_host_connections = -1, \
+    .max_connects = -1, \
+    .multiplex = -1, \
+    .max_in_flight = -1, \
+    .adaptive_limit = -1, \
+    .spill_threshold = -1, \
+    .memory_budget = -1 \
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+treq_PoolType *treq_PoolInit(const treq_PoolOptionsType *options);
+void treq_PoolFree(treq_PoolType *pool);
+void treq_PoolMultiSetOptions(CURLM *multi, const treq_PoolOptionsType *options);
+void treq_PoolSetCallbackBatch(treq_PoolType *pool, Tcl_Obj *callback_batch);
+void treq_PoolSetRateLimit(treq_PoolType *pool, treq_RateLimitType *rate_limit);
+Tcl_Obj *treq_PoolGetStats(treq_PoolType *pool);
+
 void treq_PoolThreadExitProc(void);
-int treq_PoolAddRequest(treq_RequestType *req);
+int treq_PoolAddRequest(treq_PoolType *pool, treq_RequestType *req);
 void treq_PoolRemoveRequest(treq_RequestType *req);
+int treq_PoolWaitRequests(treq_RequestType **requests, Tcl_Size count, int wait_all, int timeout);
+int treq_PoolMemoryAcquire(treq_RequestType *req, size_t size);
+void treq_PoolMemoryUpdate(treq_RequestType *req);
+
+int treq_PoolSetIoThreads(Tcl_Interp *interp, treq_PoolType *pool, int count);
+int treq_PoolGetIoThreads(treq_PoolType *pool);
+int treq_PoolDefaultSetIoThreads(Tcl_Interp *interp, int count);
+int treq_PoolDefaultGetIoThreads(void);
+int treq_PoolDefaultSetMaxInFlight(Tcl_Interp *interp, int max_in_flight);
+int treq_PoolDefaultGetMaxInFlight(void);
+void treq_PoolDefaultSetSyncViaPool(int enabled);
+int treq_PoolDefaultGetSyncViaPool(void);
+int treq_PoolDefaultRunRequest(treq_RequestType *req);
+void treq_PoolCallbackEnter(void);
+void treq_PoolCallbackLeave(void);
+int treq_PoolIsInCallback(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,202 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqRateLimit.h"
+
+// Token bucket rate limiter. Each rule limits the hosts that match its
+// pattern, and each matching host has its own bucket. A bucket is filled
+// with rps tokens per second up to the burst value, and each request
+// takes one token. Limiters are used only by the thread that created them.
+
+typedef struct treq_RateLimitRuleType {
+    Tcl_Obj *pattern;
+    double rps;
+    double burst;
+} treq_RateLimitRuleType;
+
+typedef struct treq_RateLimitBucketType {
+    treq_RateLimitRuleType *rule;
+    double tokens;
+    // The time of the last refill in microseconds
+    Tcl_WideInt updated;
+} treq_RateLimitBucketType;
+
+struct treq_RateLimitType {
+    treq_RateLimitRuleType *rules;
+    Tcl_Size rules_count;
+    // Buckets keyed by host name. A NULL value means that the host
+    // doesn't match any rule.
+    Tcl_HashTable buckets;
+    int refcount;
+};
+
+Tcl_WideInt treq_RateLimitGetTime(void) {
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (Tcl_WideInt)now.sec * 1000000 + now.usec;
+}
+
+static void treq_RateLimitFree(treq_RateLimitType *rl) {
+
+    DBG2(printf("enter; rl: %p", (void *)rl));
+
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&rl->buckets, &search);
+        entry != NULL; entry = Tcl_NextHashEntry(&search))
+    {
+        ckfree(Tcl_GetHashValue(entry));
+    }
+    Tcl_DeleteHashTable(&rl->buckets);
+
+    for (Tcl_Size i = 0; i < rl->rules_count; i++) {
+        Tcl_DecrRefCount(rl->rules[i].pattern);
+    }
+    ckfree(rl->rules);
+
+    ckfree(rl);
+
+    DBG2(printf("return: ok"));
+
+}
+
+// Creates a limiter from the list {host_pattern rps burst ?host_pattern rps burst ...?}.
+// The returned limiter has a zero reference count.
+treq_RateLimitType *treq_RateLimitFromObj(Tcl_Interp *interp, Tcl_Obj *obj) {
+
+    DBG2(printf("enter; obj: [%s]", Tcl_GetString(obj)));
+
+    Tcl_Size objc;
+    Tcl_Obj **objv;
+    if (Tcl_ListObjGetElements(NULL, obj, &objc, &objv) != TCL_OK || objc == 0 || (objc % 3) != 0) {
+        goto wrong_format;
+    }
+
+    treq_RateLimitType *rl = ckalloc(sizeof(treq_RateLimitType));
+    memset(rl, 0, sizeof(treq_RateLimitType));
+
+    rl->rules = ckalloc(sizeof(treq_RateLimitRuleType) * (objc / 3));
+    Tcl_InitHashTable(&rl->buckets, TCL_STRING_KEYS);
+
+    for (Tcl_Size i = 0; i < objc; i += 3) {
+
+        double rps;
+        int burst;
+
+        if (Tcl_GetDoubleFromObj(NULL, objv[i + 1], &rps) != TCL_OK || !(rps > 0) ||
+            Tcl_GetIntFromObj(NULL, objv[i + 2], &burst) != TCL_OK || burst < 1)
+        {
+            treq_RateLimitFree(rl);
+            goto wrong_format;
+        }
+
+        treq_RateLimitRuleType *rule = &rl->rules[rl->rules_count++];
+        rule->pattern = objv[i];
+        Tcl_IncrRefCount(rule->pattern);
+        rule->rps = rps;
+        rule->burst = burst;
+
+        DBG2(printf("add rule: [%s] %f rps, burst %d", Tcl_GetString(rule->pattern), rps, burst));
+
+    }
+
+    DBG2(printf("return: ok (%p)", (void *)rl));
+    return rl;
+
+wrong_format:
+
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s option is expected as a list of host"
+        " pattern, positive requests per second and burst values, but got \"%s\"",
+        "-rate_limit", Tcl_GetString(obj)));
+    DBG2(printf("return: ERROR (wrong format)"));
+    return NULL;
+
+}
+
+void treq_RateLimitIncrRefCount(treq_RateLimitType *rl) {
+    rl->refcount++;
+}
+
+void treq_RateLimitDecrRefCount(treq_RateLimitType *rl) {
+    if (--rl->refcount <= 0) {
+        treq_RateLimitFree(rl);
+    }
+}
+
+// Returns the bucket for the host, refilled up to the specified time,
+// or NULL if the host is not limited
+static treq_RateLimitBucketType *treq_RateLimitGetBucket(treq_RateLimitType *rl, const char *host, Tcl_WideInt now) {
+
+    treq_RateLimitBucketType *bucket;
+
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&rl->buckets, host);
+
+    if (entry == NULL) {
+
+        // The first rule that matches the host is used. Hosts that match
+        // no rule get no entry, otherwise every host ever requested through
+        // the pool would stay in the table. The rules are few, so matching
+        // them again for such hosts is cheap.
+        for (Tcl_Size i = 0; i < rl->rules_count; i++) {
+            treq_RateLimitRuleType *rule = &rl->rules[i];
+            if (Tcl_StringCaseMatch(host, Tcl_GetString(rule->pattern), 1)) {
+                DBG2(printf("new bucket for host [%s]", host));
+                bucket = ckalloc(sizeof(treq_RateLimitBucketType));
+                bucket->rule = rule;
+                bucket->tokens = rule->burst;
+                bucket->updated = now;
+                int is_new;
+                entry = Tcl_CreateHashEntry(&rl->buckets, host, &is_new);
+                Tcl_SetHashValue(entry, bucket);
+                return bucket;
+            }
+        }
+
+        return NULL;
+
+    }
+
+    bucket = (treq_RateLimitBucketType *)Tcl_GetHashValue(entry);
+
+    if (now > bucket->updated) {
+        bucket->tokens += (double)(now - bucket->updated) * bucket->rule->rps / 1000000.0;
+        if (bucket->tokens > bucket->rule->burst) {
+            bucket->tokens = bucket->rule->burst;
+        }
+        bucket->updated = now;
+    }
+
+    return bucket;
+
+}
+
+// Returns the number of microseconds until a token is available for
+// the host, or 0 if a token is available now
+Tcl_WideInt treq_RateLimitCheck(treq_RateLimitType *rl, const char *host, Tcl_WideInt now) {
+
+    treq_RateLimitBucketType *bucket = treq_RateLimitGetBucket(rl, host, now);
+
+    if (bucket == NULL || bucket->tokens >= 1.0) {
+        return 0;
+    }
+
+    // Round up to make sure the token is available at that time
+    return (Tcl_WideInt)((1.0 - bucket->tokens) * 1000000.0 / bucket->rule->rps) + 1;
+
+}
+
+// Takes a token for the host. The caller must check that the token
+// is available with treq_RateLimitCheck() first.
+void treq_RateLimitConsume(treq_RateLimitType *rl, const char *host) {
+
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&rl->buckets, host);
+    if (entry == NULL) {
+        return;
+    }
+
+    treq_RateLimitBucketType *bucket = (treq_RateLimitBucketType *)Tcl_GetHashValue(entry);
+    bucket->tokens -= 1.0;
+
+}
@@ -0,0 +1,27 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQRATELIMIT_H
+#define TREQUESTS_TREQRATELIMIT_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+treq_RateLimitType *treq_RateLimitFromObj(Tcl_Interp *interp, Tcl_Obj *obj);
+void treq_RateLimitIncrRefCount(treq_RateLimitType *rl);
+void treq_RateLimitDecrRefCount(treq_RateLimitType *rl);
+
+Tcl_WideInt treq_RateLimitGetTime(void);
+Tcl_WideInt treq_RateLimitCheck(treq_RateLimitType *rl, const char *host, Tcl_WideInt now);
+void treq_RateLimitConsume(treq_RateLimitType *rl, const char *host);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQRATELIMIT_H
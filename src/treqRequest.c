@@ -9,33 +9,280 @@
 #include "treqSession.h"
 #include "treqPool.h"
 #include "treqRequestAuth.h"
-
-typedef struct treq_RequestEvent {
-    Tcl_Event header;
-    treq_RequestType *request;
-} treq_RequestEvent;
+#include "treqEasyCache.h"
+#include "treqShare.h"
+#include "treqRateLimit.h"
+#include "treqChannel.h"
+#include "treqUtf8.h"
+
+typedef struct ThreadSpecificData {
+
+    // Requests whose callbacks are scheduled, in order of completion. They
+    // are processed in batches by a single Tcl event, so the cost of the
+    // event and the interp state is shared by all requests completed
+    // by one pass of the event loop.
+    treq_RequestType *callback_head;
+    treq_RequestType *callback_tail;
+    int is_event_queued;
+    // The number of the next batch. Requests that are scheduled while
+    // a batch is being processed belong to the next batch.
+    Tcl_WideInt batch_seq;
+
+    // Argument buffer reused by callbacks. It is not used by callbacks
+    // that run in nested event loops while it is busy.
+    Tcl_Obj **objv;
+    Tcl_Size objv_size;
+    int is_objv_busy;
+
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+// Batch callbacks of the pools whose requests are completed in the same
+// batch. The list of request handles is collected for each of them.
+typedef struct treq_RequestBatchType {
+    Tcl_Interp *interp;
+    Tcl_Obj *callback;
+    Tcl_Obj *handles;
+} treq_RequestBatchType;
 
 static Tcl_EventProc treq_RequestEventProc;
 
+static void treq_RequestCallbackRemove(ThreadSpecificData *tsdPtr, treq_RequestType *req) {
+
+    if (req->callback_prev == NULL) {
+        tsdPtr->callback_head = req->callback_next;
+    } else {
+        req->callback_prev->callback_next = req->callback_next;
+    }
+
+    if (req->callback_next == NULL) {
+        tsdPtr->callback_tail = req->callback_prev;
+    } else {
+        req->callback_next->callback_prev = req->callback_prev;
+    }
+
+    req->callback_prev = req->callback_next = NULL;
+    req->is_callback_pending = 0;
+
+}
+
+// Evaluates the command and reports errors as background exceptions.
+// The caller must save the interp state.
+static void treq_RequestEvalObjv(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[], int flags) {
+    int rc = Tcl_EvalObjv(interp, objc, objv, flags);
+    if (rc != TCL_OK) {
+        Tcl_BackgroundException(interp, rc);
+        Tcl_ResetResult(interp);
+    }
+}
+
+// Runs the callback with the request handle as the last argument. Unlike
+// treq_ExecuteTclCallback(), it doesn't create a new list for the command.
+static void treq_RequestEvalCallback(ThreadSpecificData *tsdPtr, Tcl_Interp *interp, Tcl_Obj *callback, Tcl_Obj *arg) {
+
+    Tcl_Size objc;
+    Tcl_Obj **objv;
+    if (Tcl_ListObjGetElements(interp, callback, &objc, &objv) != TCL_OK) {
+        Tcl_BackgroundException(interp, TCL_ERROR);
+        Tcl_ResetResult(interp);
+        return;
+    }
+
+    Tcl_Obj *objv_static[8];
+    Tcl_Obj **cmd_objv;
+
+    if (!tsdPtr->is_objv_busy) {
+        if (tsdPtr->objv_size < objc + 1) {
+            tsdPtr->objv_size = objc + 8;
+            tsdPtr->objv = ckrealloc(tsdPtr->objv, sizeof(Tcl_Obj *) * tsdPtr->objv_size);
+        }
+        cmd_objv = tsdPtr->objv;
+        tsdPtr->is_objv_busy = 1;
+    } else if (objc + 1 <= 8) {
+        cmd_objv = objv_static;
+    } else {
+        cmd_objv = ckalloc(sizeof(Tcl_Obj *) * (objc + 1));
+    }
+
+    // The callback may change its list representation while it runs,
+    // so the elements must be referenced by us
+    for (Tcl_Size i = 0; i < objc; i++) {
+        cmd_objv[i] = objv[i];
+        Tcl_IncrRefCount(cmd_objv[i]);
+    }
+    cmd_objv[objc] = arg;
+
+    treq_RequestEvalObjv(interp, objc + 1, cmd_objv, 0);
+
+    for (Tcl_Size i = 0; i < objc; i++) {
+        Tcl_DecrRefCount(cmd_objv[i]);
+    }
+
+    if (cmd_objv == tsdPtr->objv) {
+        tsdPtr->is_objv_busy = 0;
+    } else if (cmd_objv != objv_static) {
+        ckfree(cmd_objv);
+    }
+
+}
+
+// Runs the callback, sets the variable and resumes the coroutine of
+// the completed request. The request handle is added to the list of
+// its batch callback.
+static void treq_RequestRunCallbacks(ThreadSpecificData *tsdPtr, treq_RequestType *req,
+    treq_RequestBatchType **batches_ptr, treq_RequestBatchType *batches_static,
+    Tcl_Size *batches_count_ptr, Tcl_Size *batches_size_ptr)
+{
+
+    // Setting the variable can fire traces that destroy the request.
+    // Keep everything we need for the callback.
+    Tcl_Interp *interp = req->interp;
+    Tcl_Obj *callback = req->callback;
+    Tcl_Obj *cmd_name = req->cmd_name;
+    Tcl_Obj *variable = req->variable;
+    Tcl_Obj *callback_batch = req->callback_batch;
+
+    // The request is no longer awaited once the coroutine is resumed.
+    // We take the reference to the coroutine name from the request.
+    Tcl_Obj *await_coro = req->await_coro;
+    req->await_coro = NULL;
+
+    if (callback_batch != NULL) {
+
+        treq_RequestBatchType *batches = *batches_ptr;
+        Tcl_Size i;
+        for (i = 0; i < *batches_count_ptr; i++) {
+            if (batches[i].callback == callback_batch && batches[i].interp == interp) {
+                break;
+            }
+        }
+
+        if (i == *batches_count_ptr) {
+            if (i == *batches_size_ptr) {
+                *batches_size_ptr *= 2;
+                if (batches == batches_static) {
+                    batches = ckalloc(sizeof(treq_RequestBatchType) * *batches_size_ptr);
+                    memcpy(batches, batches_static, sizeof(treq_RequestBatchType) * i);
+                } else {
+                    batches = ckrealloc(batches, sizeof(treq_RequestBatchType) * *batches_size_ptr);
+                }
+                *batches_ptr = batches;
+            }
+            batches[i].interp = interp;
+            batches[i].callback = callback_batch;
+            Tcl_IncrRefCount(callback_batch);
+            batches[i].handles = Tcl_NewListObj(0, NULL);
+            Tcl_IncrRefCount(batches[i].handles);
+            (*batches_count_ptr)++;
+        }
+
+        Tcl_ListObjAppendElement(NULL, batches[i].handles, cmd_name);
+
+    }
+
+    Tcl_IncrRefCount(cmd_name);
+    if (callback != NULL) {
+        Tcl_IncrRefCount(callback);
+    }
+
+    if (variable != NULL) {
+        DBG2(printf("set variable: %s", Tcl_GetString(variable)));
+        Tcl_IncrRefCount(variable);
+        if (Tcl_ObjSetVar2(interp, variable, NULL, cmd_name, TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
+            Tcl_BackgroundException(interp, TCL_ERROR);
+            Tcl_ResetResult(interp);
+        }
+        Tcl_DecrRefCount(variable);
+    }
+
+    if (callback != NULL) {
+        treq_RequestEvalCallback(tsdPtr, interp, callback, cmd_name);
+        Tcl_DecrRefCount(callback);
+    }
+
+    if (await_coro != NULL) {
+        // Resume the coroutine directly with its command name and
+        // the request handle, without building a callback script.
+        DBG2(printf("resume coroutine: %s", Tcl_GetString(await_coro)));
+        Tcl_Obj *objv[2] = { await_coro, cmd_name };
+        treq_RequestEvalObjv(interp, 2, objv, TCL_EVAL_GLOBAL);
+        Tcl_DecrRefCount(await_coro);
+    }
+
+    Tcl_DecrRefCount(cmd_name);
+
+}
+
 static int treq_RequestEventProc(Tcl_Event *evPtr, int flags) {
 
+    UNUSED(evPtr);
+
     // Ignore non-file events
     if (!(flags & TCL_FILE_EVENTS)) {
         return 0;
     }
 
-    DBG2(printf("enter"));
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
 
-    treq_RequestType *req = ((treq_RequestEvent *)evPtr)->request;
+    // Requests scheduled from now on need a new event
+    tsdPtr->is_event_queued = 0;
+    Tcl_WideInt batch = tsdPtr->batch_seq++;
+
+    DBG2(printf("enter; batch: %" TCL_LL_MODIFIER "d", (long long)batch));
+
+    treq_RequestBatchType batches_static[4], *batches = batches_static;
+    Tcl_Size batches_count = 0, batches_size = 4;
+
+    // The interp state is saved once for consecutive requests
+    // of the same interp
+    Tcl_Interp *interp = NULL;
+    Tcl_InterpState state = NULL;
+
+    treq_RequestType *req;
+    // If the event is processed in a nested event loop of a callback,
+    // the remaining requests of the outer batch are processed here
+    while ((req = tsdPtr->callback_head) != NULL && req->callback_batch_seq <= batch) {
+
+        treq_RequestCallbackRemove(tsdPtr, req);
+
+        if (req->interp != interp) {
+            if (interp != NULL) {
+                Tcl_RestoreInterpState(interp, state);
+                Tcl_Release(interp);
+            }
+            interp = req->interp;
+            Tcl_Preserve(interp);
+            state = Tcl_SaveInterpState(interp, TCL_OK);
+        }
+
+        if (Tcl_InterpDeleted(interp)) {
+            DBG2(printf("skip request %p (interp is deleted)", (void *)req));
+            continue;
+        }
+
+        DBG2(printf("run callbacks for request %p", (void *)req));
+        treq_RequestRunCallbacks(tsdPtr, req, &batches, batches_static, &batches_count, &batches_size);
 
-    if (req == NULL) {
-        DBG2(printf("return: ok (request has already been destroyed)"));
-        return 1;
     }
 
-    req->callback_event = NULL;
+    if (interp != NULL) {
+        Tcl_RestoreInterpState(interp, state);
+        Tcl_Release(interp);
+    }
 
-    treq_ExecuteTclCallback(req->interp, req->callback, 1, &req->cmd_name, 1);
+    for (Tcl_Size i = 0; i < batches_count; i++) {
+        DBG2(printf("run batch callback with %s", Tcl_GetString(batches[i].handles)));
+        if (!Tcl_InterpDeleted(batches[i].interp)) {
+            treq_ExecuteTclCallback(batches[i].interp, batches[i].callback, 1, &batches[i].handles, 1);
+        }
+        Tcl_DecrRefCount(batches[i].callback);
+        Tcl_DecrRefCount(batches[i].handles);
+    }
+
+    if (batches != batches_static) {
+        ckfree(batches);
+    }
 
     DBG2(printf("return: ok"));
     return 1;
@@ -46,8 +293,22 @@ void treq_RequestScheduleCallback(treq_RequestType *req) {
 
     DBG2(printf("enter"));
 
-    if (req->callback == NULL) {
-        DBG2(printf("return: ok (request has no callback)"));
+    // Sync requests can be completed by a pool when they are run
+    // through it, but they have nothing to schedule
+    if (!req->async) {
+        DBG2(printf("return: ok (sync request)"));
+        return;
+    }
+
+    if (req->callback == NULL && req->variable == NULL && req->await_coro == NULL &&
+        req->callback_batch == NULL)
+    {
+        DBG2(printf("return: ok (request has no callback, variable or coroutine)"));
+        return;
+    }
+
+    if (req->is_callback_pending) {
+        DBG2(printf("return: ok (already scheduled)"));
         return;
     }
 
@@ -56,16 +317,41 @@ void treq_RequestScheduleCallback(treq_RequestType *req) {
         return;
     }
 
-    treq_RequestEvent *event = ckalloc(sizeof(treq_RequestEvent));
-    event->header.proc = treq_RequestEventProc;
-    event->request = req;
-    req->callback_event = event;
-    Tcl_QueueEvent((Tcl_Event *)event, TCL_QUEUE_TAIL);
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    req->callback_batch_seq = tsdPtr->batch_seq;
+    req->callback_next = NULL;
+    req->callback_prev = tsdPtr->callback_tail;
+    if (tsdPtr->callback_tail == NULL) {
+        tsdPtr->callback_head = req;
+    } else {
+        tsdPtr->callback_tail->callback_next = req;
+    }
+    tsdPtr->callback_tail = req;
+    req->is_callback_pending = 1;
+
+    if (!tsdPtr->is_event_queued) {
+        DBG2(printf("queue the callback event"));
+        Tcl_Event *event = ckalloc(sizeof(Tcl_Event));
+        event->proc = treq_RequestEventProc;
+        Tcl_QueueEvent(event, TCL_QUEUE_TAIL);
+        tsdPtr->is_event_queued = 1;
+    }
 
     DBG2(printf("return: ok"));
 
 }
 
+void treq_RequestThreadExitProc(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    DBG2(printf("enter..."));
+    if (tsdPtr->objv != NULL) {
+        ckfree(tsdPtr->objv);
+        tsdPtr->objv = NULL;
+    }
+    DBG2(printf("return: ok"));
+}
+
 static int treq_RequestUpdateContentType(treq_RequestType *req) {
     DBG2(printf("enter"));
 
@@ -117,12 +403,16 @@ useDefault:
 
 Tcl_Obj *treq_RequestGetStatusCode(treq_RequestType *req) {
     long code = 0;
+    // The curl handle belongs to the I/O thread until the transfer is completed
+    if (req->io_thread != NULL) {
+        return Tcl_NewWideIntObj(code);
+    }
     curl_easy_getinfo(req->curl_easy, CURLINFO_RESPONSE_CODE, &code);
     return Tcl_NewWideIntObj(code);
 }
 
 Tcl_Obj *treq_RequestGetEncoding(treq_RequestType *req) {
-    if (req->encoding == NULL && !treq_RequestUpdateEncoding(req)) {
+    if (req->encoding == NULL && (req->io_thread != NULL || !treq_RequestUpdateEncoding(req))) {
         DBG2(printf("no encoding set, return the default: iso8859-1"));
         return Tcl_NewStringObj("iso8859-1", -1);
     }
@@ -132,6 +422,10 @@ Tcl_Obj *treq_RequestGetEncoding(treq_RequestType *req) {
 
 void treq_RequestSetEncoding(treq_RequestType *req, Tcl_Encoding encoding) {
     DBG2(printf("set encoding %p", (void *)encoding));
+    if (encoding != req->encoding) {
+        // The cached text was decoded with the previous encoding
+        Tcl_FreeObject(req->text_obj);
+    }
     req->encoding = encoding;
 }
 
@@ -157,11 +451,50 @@ Tcl_Obj *treq_RequestGetError(treq_RequestType *req) {
 
 }
 
+// Returns the response body and its size, or NULL if there is no body
+static const char *treq_RequestGetBody(treq_RequestType *req, Tcl_Size *size_ptr) {
+    if (req->io_thread != NULL) {
+        return NULL;
+    }
+    if (req->content_obj != NULL) {
+        return (const char *)Tcl_GetByteArrayFromObj(req->content_obj, size_ptr);
+    }
+    *size_ptr = req->content.size;
+    return treq_BufferGetData(&req->content);
+}
+
+// The body of a completed request doesn't change anymore, so the objects
+// created from it can be kept in the request. The body in a temporary file
+// is not kept in memory, as the file is used to save memory.
+static int treq_RequestIsBodyCacheable(treq_RequestType *req) {
+    return (treq_RequestIsCompleted(req) && req->channel == NULL && !treq_BufferIsSpilled(&req->content));
+}
+
+// Returns true if the body in the specified encoding has the same
+// representation in Tcl, so that it can be used without conversion
+static int treq_RequestIsTextNative(Tcl_Encoding encoding, const char *data, Tcl_Size size) {
+    const char *name = Tcl_GetEncodingName(encoding);
+    if (strcmp(name, "utf-8") == 0) {
+        return treq_Utf8IsTclString(data, size);
+    }
+    if (strcmp(name, "ascii") == 0 || strcmp(name, "iso8859-1") == 0) {
+        return treq_Utf8IsAscii(data, size);
+    }
+    return 0;
+}
+
 Tcl_Obj *treq_RequestGetText(treq_RequestType *req) {
 
     DBG2(printf("enter"));
 
-    if (req->content == NULL) {
+    if (req->text_obj != NULL) {
+        DBG2(printf("return: ok (cached)"));
+        return req->text_obj;
+    }
+
+    Tcl_Size size;
+    const char *data = treq_RequestGetBody(req, &size);
+    if (data == NULL) {
         return Tcl_NewObj();
     }
 
@@ -174,10 +507,22 @@ Tcl_Obj *treq_RequestGetText(treq_RequestType *req) {
         encoding = req->encoding;
     }
 
-    Tcl_DString ds;
-    const char *value = Tcl_ExternalToUtfDString(encoding, req->content, req->content_size, &ds);
-    Tcl_Obj *result = Tcl_NewStringObj(value, Tcl_DStringLength(&ds));
-    Tcl_DStringFree(&ds);
+    Tcl_Obj *result;
+    if (treq_RequestIsTextNative(encoding, data, size)) {
+        DBG2(printf("use the body as is"));
+        result = Tcl_NewStringObj(data, size);
+    } else {
+        Tcl_DString ds;
+        const char *value = Tcl_ExternalToUtfDString(encoding, data, size, &ds);
+        result = Tcl_NewStringObj(value, Tcl_DStringLength(&ds));
+        Tcl_DStringFree(&ds);
+    }
+
+    if (treq_RequestIsBodyCacheable(req)) {
+        DBG2(printf("cache the text object"));
+        req->text_obj = result;
+        Tcl_IncrRefCount(result);
+    }
 
     DBG2(printf("return: ok"));
     return result;
@@ -185,15 +530,71 @@ Tcl_Obj *treq_RequestGetText(treq_RequestType *req) {
 }
 
 Tcl_Obj *treq_RequestGetContent(treq_RequestType *req) {
-    return (req->content == NULL ?
-        Tcl_NewObj() :
-        Tcl_NewByteArrayObj((const unsigned char *)req->content, req->content_size));
+
+    if (req->content_obj != NULL) {
+        DBG2(printf("return: ok (cached)"));
+        return req->content_obj;
+    }
+
+    const char *data;
+    if (req->io_thread != NULL || (data = treq_BufferGetData(&req->content)) == NULL) {
+        return Tcl_NewObj();
+    }
+
+    Tcl_Obj *result = Tcl_NewByteArrayObj((const unsigned char *)data, req->content.size);
+
+    // Keep the object and release the buffer, so that the next calls
+    // return the same object without copying the body. Since the object
+    // is shared, a script that modifies it gets its own copy.
+    if (treq_RequestIsBodyCacheable(req)) {
+        DBG2(printf("cache the content object"));
+        req->content_obj = result;
+        Tcl_IncrRefCount(result);
+        treq_BufferFree(&req->content);
+    }
+
+    return result;
+
+}
+
+// Moves the body from the content object back to the buffer, so that
+// it can be read by the response channel. The cached text is released
+// as well, since the channel consumes the body. Returns 0 if the memory
+// could not be allocated.
+int treq_RequestReleaseContentObj(treq_RequestType *req) {
+
+    Tcl_FreeObject(req->text_obj);
+
+    if (req->content_obj == NULL) {
+        return 1;
+    }
+
+    DBG2(printf("enter; req: %p", (void *)req));
+
+    Tcl_Size size;
+    const char *data = (const char *)Tcl_GetByteArrayFromObj(req->content_obj, &size);
+    if (!treq_BufferAppend(&req->content, data, size)) {
+        req->content.failed_size = 0;
+        DBG2(printf("return: ERROR (failed to alloc)"));
+        return 0;
+    }
+
+    Tcl_DecrRefCount(req->content_obj);
+    req->content_obj = NULL;
+
+    DBG2(printf("return: ok"));
+    return 1;
+
 }
 
 Tcl_Obj *treq_RequestGetHeaders(treq_RequestType *req) {
 
     Tcl_Obj *result = Tcl_NewListObj(0, NULL);
 
+    if (req->io_thread != NULL) {
+        return result;
+    }
+
     struct curl_header *prev = NULL;
     struct curl_header *h;
 
@@ -211,7 +612,7 @@ Tcl_Obj *treq_RequestGetHeader(treq_RequestType *req, const char *header) {
 
     struct curl_header *h;
 
-    if (curl_easy_header(req->curl_easy, header, 0, CURLH_HEADER, -1, &h) != CURLHE_OK) {
+    if (req->io_thread != NULL || curl_easy_header(req->curl_easy, header, 0, CURLH_HEADER, -1, &h) != CURLHE_OK) {
         return NULL;
     }
 
@@ -259,6 +660,9 @@ Tcl_Obj *treq_RequestGetState(treq_RequestType *req) {
     case TREQ_REQUEST_CREATED:
         state = "created";
         break;
+    case TREQ_REQUEST_QUEUED:
+        state = "queued";
+        break;
     case TREQ_REQUEST_INPROGRESS:
         state = "progress";
         break;
@@ -345,7 +749,9 @@ static int treq_debug_callback(CURL *handle, curl_infotype type, char *data, siz
         (req->cmd_name == NULL ? Tcl_NewObj() : req->cmd_name)
     };
 
+    treq_PoolCallbackEnter();
     treq_ExecuteTclCallback(req->interp, req->callback_debug, 3, objv, 0);
+    treq_PoolCallbackLeave();
 
     goto done;
 
@@ -384,44 +790,242 @@ done:
     return 0;
 }
 
-static size_t treq_write_callback(const char *ptr, size_t size, size_t nmemb, void *userdata) {
+// Passes the chunk of the response body to the -on_data script. The script
+// is called with the chunk as a byte array and the response handle. If
+// the script returns the continue code, the transfer of an async request
+// is paused until the resume command of the response handle. The break
+// code or an error aborts the transfer.
+static size_t treq_RequestDataCallback(treq_RequestType *req, const char *ptr, size_t size) {
 
-    treq_RequestType *req = (treq_RequestType *)userdata;
-    size = size * nmemb;
+    DBG2(printf("enter; chunk size: %zu", size));
 
-    DBG2(printf("enter; existing buffer size: %" TCL_SIZE_MODIFIER "d; add chunk size: %zu", req->content_size, size));
+    Tcl_Interp *interp = req->interp;
 
-    if (size > 0) {
+    Tcl_Size objc;
+    Tcl_Obj **objv;
+    Tcl_ListObjGetElements(NULL, req->on_data, &objc, &objv);
 
-        if (req->content_size == 0) {
-            req->content = attemptckalloc(size);
-            if (req->content == NULL) {
-                goto error;
-            }
+    Tcl_Obj *cmd_objv_static[8];
+    Tcl_Obj **cmd_objv = (objc + 2 <= 8 ? cmd_objv_static : ckalloc(sizeof(Tcl_Obj *) * (objc + 2)));
+
+    for (Tcl_Size i = 0; i < objc; i++) {
+        cmd_objv[i] = objv[i];
+    }
+    cmd_objv[objc] = Tcl_NewByteArrayObj((const unsigned char *)ptr, size);
+    cmd_objv[objc + 1] = (req->cmd_name == NULL ? Tcl_NewObj() : req->cmd_name);
+
+    for (Tcl_Size i = 0; i < objc + 2; i++) {
+        Tcl_IncrRefCount(cmd_objv[i]);
+    }
+
+    Tcl_Preserve(interp);
+    Tcl_InterpState state = Tcl_SaveInterpState(interp, TCL_OK);
+
+    req->is_on_data_running = 1;
+    treq_PoolCallbackEnter();
+    int rc = Tcl_EvalObjv(interp, objc + 2, cmd_objv, 0);
+    treq_PoolCallbackLeave();
+    req->is_on_data_running = 0;
+
+    size_t result;
+
+    switch (rc) {
+    case TCL_OK:
+        result = size;
+        break;
+    case TCL_CONTINUE:
+        if (req->async) {
+            DBG2(printf("pause the transfer"));
+            req->is_paused = 1;
+            result = CURL_WRITEFUNC_PAUSE;
         } else {
-            char *tmp = attemptckrealloc(req->content, req->content_size + size);
-            if (tmp == NULL) {
-                goto error;
+            req->write_error = Tcl_NewStringObj("-on_data callback can pause only"
+                " asynchronous requests", -1);
+            result = CURL_WRITEFUNC_ERROR;
+        }
+        break;
+    case TCL_BREAK:
+        DBG2(printf("abort the transfer"));
+        req->write_error = Tcl_NewStringObj("transfer aborted by -on_data callback", -1);
+        result = CURL_WRITEFUNC_ERROR;
+        break;
+    default:
+        req->write_error = Tcl_ObjPrintf("-on_data callback failed: %s", Tcl_GetStringResult(interp));
+        result = CURL_WRITEFUNC_ERROR;
+        break;
+    }
+
+    if (req->write_error != NULL) {
+        Tcl_IncrRefCount(req->write_error);
+    }
+
+    Tcl_RestoreInterpState(interp, state);
+    Tcl_Release(interp);
+
+    for (Tcl_Size i = 0; i < objc + 2; i++) {
+        Tcl_DecrRefCount(cmd_objv[i]);
+    }
+
+    if (cmd_objv != cmd_objv_static) {
+        ckfree(cmd_objv);
+    }
+
+    DBG2(printf("return: %s", (result == size ? "ok" : (result == CURL_WRITEFUNC_PAUSE ? "pause" : "ERROR"))));
+    return result;
+
+}
+
+// Calls the -on_headers script with the response handle when the headers
+// of the final response are received, i.e. with the first chunk of
+// the body or on completion of a response without a body. The break code
+// or an error aborts the transfer. Returns 0 if the transfer should be
+// aborted.
+static int treq_RequestHeadersCallback(treq_RequestType *req) {
+
+    DBG2(printf("enter"));
+
+    req->is_headers_notified = 1;
+
+    Tcl_Interp *interp = req->interp;
+
+    Tcl_Obj *cmd = Tcl_DuplicateObj(req->on_headers);
+    Tcl_IncrRefCount(cmd);
+    Tcl_ListObjAppendElement(NULL, cmd, (req->cmd_name == NULL ? Tcl_NewObj() : req->cmd_name));
+
+    Tcl_Preserve(interp);
+    Tcl_InterpState state = Tcl_SaveInterpState(interp, TCL_OK);
+
+    req->is_on_headers_running = 1;
+    treq_PoolCallbackEnter();
+    int rc = Tcl_EvalObjEx(interp, cmd, TCL_EVAL_DIRECT);
+    treq_PoolCallbackLeave();
+    req->is_on_headers_running = 0;
+
+    switch (rc) {
+    case TCL_OK:
+        break;
+    case TCL_BREAK:
+        DBG2(printf("abort the transfer"));
+        req->write_error = Tcl_NewStringObj("transfer aborted by -on_headers callback", -1);
+        break;
+    default:
+        req->write_error = Tcl_ObjPrintf("-on_headers callback failed: %s", Tcl_GetStringResult(interp));
+        break;
+    }
+
+    if (req->write_error != NULL) {
+        Tcl_IncrRefCount(req->write_error);
+    }
+
+    Tcl_RestoreInterpState(interp, state);
+    Tcl_Release(interp);
+
+    Tcl_DecrRefCount(cmd);
+
+    DBG2(printf("return: %s", (rc == TCL_OK ? "ok" : "ERROR")));
+    return (rc == TCL_OK);
+
+}
+
+static size_t treq_RequestWrite(treq_RequestType *req, const char *ptr, size_t size) {
+
+    if (req->on_data != NULL) {
+        return treq_RequestDataCallback(req, ptr, size);
+    }
+
+    if (req->channel != NULL) {
+        return treq_ChannelWrite(req->channel, ptr, size);
+    }
+
+    if (req->is_channel_closed) {
+        DBG2(printf("abort the transfer, the channel is closed"));
+        if (req->write_error == NULL) {
+            req->write_error = Tcl_NewStringObj("transfer aborted because the response"
+                " channel has been closed", -1);
+            Tcl_IncrRefCount(req->write_error);
+        }
+        return CURL_WRITEFUNC_ERROR;
+    }
+
+    DBG2(printf("enter; existing buffer size: %" TCL_SIZE_MODIFIER "d; add chunk size: %zu", req->content.size, size));
+
+    // The headers have arrived with the first chunk of the body. If the size
+    // of the body is known, allocate the whole buffer or the output file
+    // at once. If it fails for the buffer, the buffer will grow as usual,
+    // and the error will be reported only if the body actually doesn't fit
+    // in memory.
+    if (!req->is_content_presized) {
+        req->is_content_presized = 1;
+        curl_off_t length;
+        if (curl_easy_getinfo(req->curl_easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK &&
+            length > 0)
+        {
+            DBG2(printf("presize the output for %" CURL_FORMAT_CURL_OFF_T " bytes", length));
+            if (req->output != NULL) {
+                if (!treq_OutputReserve(req->output, (Tcl_WideInt)length)) {
+                    return CURL_WRITEFUNC_ERROR;
+                }
+            } else {
+                treq_BufferReserve(&req->content, (size_t)length);
             }
-            req->content = tmp;
         }
+    }
 
-        memcpy(&req->content[req->content_size], ptr, size);
-        req->content_size += size;
+    if (req->output != NULL) {
+        if (!treq_OutputWrite(req->output, ptr, size)) {
+            return CURL_WRITEFUNC_ERROR;
+        }
+        return size;
+    }
 
+    if (!treq_PoolMemoryAcquire(req, size)) {
+        return CURL_WRITEFUNC_PAUSE;
     }
 
-    return size;
+    int is_ok = treq_BufferAppend(&req->content, ptr, size);
+    treq_PoolMemoryUpdate(req);
 
-error:
+    return (is_ok ? size : CURL_WRITEFUNC_ERROR);
+
+}
+
+static size_t treq_write_callback(const char *ptr, size_t size, size_t nmemb, void *userdata) {
 
-    treq_RequestSetError(req, Tcl_ObjPrintf("failed to allocate %ld additional bytes in"
-        " the output buffer, current output buffer size is %ld", (long)size, (long)req->content_size));
-    return CURL_WRITEFUNC_ERROR;
+    treq_RequestType *req = (treq_RequestType *)userdata;
+    size = size * nmemb;
+
+    // The first chunk of the body means that the headers of the final
+    // response are complete. Curl doesn't call us for the bodies of
+    // redirects that it follows.
+    if (req->on_headers != NULL && !req->is_headers_notified && !treq_RequestHeadersCallback(req)) {
+        return CURL_WRITEFUNC_ERROR;
+    }
+
+    // curl checks the limit against Content-Length, but the length can be
+    // unknown, or the body can be decompressed to a much larger size.
+    // Thus, the limit is also checked for the actual body before the chunk
+    // is stored anywhere.
+    if (req->max_size != -1 && (Tcl_WideInt)size > req->max_size - req->received_size) {
+        DBG2(printf("abort the transfer, the body exceeds the limit"));
+        req->is_max_size_exceeded = 1;
+        return CURL_WRITEFUNC_ERROR;
+    }
+
+    size_t result = treq_RequestWrite(req, ptr, size);
+
+    // A paused chunk is passed again when the transfer is resumed, so only
+    // accepted chunks are counted
+    if (result == size) {
+        req->received_size += (Tcl_WideInt)size;
+    }
+
+    return result;
 
 }
 
-void treq_RequestRun(treq_RequestType *req) {
+// Applies request parameters to the easy handle. On error, the request
+// error is set and TCL_ERROR is returned.
+int treq_RequestPrepare(treq_RequestType *req) {
 
 #define safe_curl_easy_setopt(opt,val) { \
     CURLcode __curl_res = curl_easy_setopt(req->curl_easy, (opt), (val)); \
@@ -573,6 +1177,8 @@ void treq_RequestRun(treq_RequestType *req) {
 
     DBG2(printf("set allow redirects: %s", (req->allow_redirects ? "true" : "false")));
     safe_curl_easy_setopt(CURLOPT_FOLLOWLOCATION, (req->allow_redirects ? 1L : 0L));
+    DBG2(printf("set fail on error: %s", (req->fail_on_error ? "true" : "false")));
+    safe_curl_easy_setopt(CURLOPT_FAILONERROR, (req->fail_on_error ? 1L : 0L));
     DBG2(printf("set verbose: %s", (req->verbose ? "true" : "false")));
     safe_curl_easy_setopt(CURLOPT_VERBOSE, (req->verbose ? 1L : 0L));
 
@@ -652,6 +1258,16 @@ void treq_RequestRun(treq_RequestType *req) {
         DBG2(printf("set verify peer: %s", "<default>"));
     }
 
+    if (req->max_size != -1) {
+        DBG2(printf("set max file size: %" TCL_LL_MODIFIER "d", req->max_size));
+        safe_curl_easy_setopt(CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)req->max_size);
+    }
+
+    if (req->priority != -1) {
+        DBG2(printf("set stream weight: %d", req->priority));
+        safe_curl_easy_setopt(CURLOPT_STREAM_WEIGHT, (long)req->priority);
+    }
+
     if (req->verify_status != -1) {
         safe_curl_easy_setopt(CURLOPT_SSL_VERIFYSTATUS, req->verify_status == 0 ? 0L : 1L);
         DBG2(printf("set verify status: %s", req->verify_status == 0 ? "false" : "true"));
@@ -659,11 +1275,47 @@ void treq_RequestRun(treq_RequestType *req) {
         DBG2(printf("set verify status: %s", "<default>"));
     }
 
+    if (req->output != NULL) {
+        Tcl_Obj *output_error = treq_OutputOpen(req->output);
+        if (output_error != NULL) {
+            treq_RequestSetError(req, output_error);
+            goto error;
+        }
+    }
+
     req->state = TREQ_REQUEST_INPROGRESS;
 
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+error:
+
+    DBG2(printf("return: ERROR"));
+    return TCL_ERROR;
+
+}
+
+void treq_RequestRun(treq_RequestType *req) {
+
+    DBG2(printf("enter..."));
+
+    if (treq_RequestPrepare(req) != TCL_OK) {
+        goto error;
+    }
+
     if (req->async) {
 
-        if (treq_PoolAddRequest(req) != TCL_OK) {
+        if (treq_PoolAddRequest(req->async_pool, req) != TCL_OK) {
+            treq_RequestSetError(req, Tcl_NewStringObj("failed to add the request to the pool", -1));
+            goto error;
+        }
+
+    } else if (treq_PoolDefaultGetSyncViaPool() || req->rate_limit != NULL) {
+
+        // Requests with a rate limit are held by the pool until the token
+        // is available. Meanwhile, the pool keeps serving other requests.
+        DBG2(printf("run cURL request in the default pool..."));
+        if (treq_PoolDefaultRunRequest(req) != TCL_OK) {
             treq_RequestSetError(req, Tcl_NewStringObj("failed to add the request to the pool", -1));
             goto error;
         }
@@ -671,15 +1323,7 @@ void treq_RequestRun(treq_RequestType *req) {
     } else {
 
         DBG2(printf("run cURL request..."));
-        CURLcode res = curl_easy_perform(req->curl_easy);
-
-        if (res == CURLE_OK) {
-            req->state = TREQ_REQUEST_DONE;
-            DBG2(printf("request: ok"));
-        } else {
-            req->state = TREQ_REQUEST_ERROR;
-            DBG2(printf("request: ERROR (%s)", Tcl_GetString(treq_RequestGetError(req))));
-        }
+        treq_RequestComplete(req, curl_easy_perform(req->curl_easy));
 
     }
 
@@ -696,33 +1340,200 @@ error:
 
 }
 
+// Releases the partial body of the response that exceeds the -max_size
+// limit. The body is dropped wherever it is kept: in the buffer, in
+// the temporary file or in the unread data of the channel. The output
+// file is removed later, since the request is failed.
+static void treq_RequestDiscardContent(treq_RequestType *req) {
+
+    DBG2(printf("enter; req: %p size: %" TCL_SIZE_MODIFIER "d", (void *)req, req->content.size));
+
+    Tcl_FreeObject(req->content_obj);
+    Tcl_FreeObject(req->text_obj);
+
+    if (req->channel != NULL) {
+        treq_ChannelDiscard(req->channel);
+    } else {
+        treq_BufferFree(&req->content);
+    }
+
+    // Return the bytes to the memory budget of the pool
+    treq_PoolMemoryUpdate(req);
+
+}
+
+void treq_RequestComplete(treq_RequestType *req, CURLcode result) {
+
+    DBG2(printf("enter; req: %p", (void *)req));
+
+    // The response has no body, so the -on_headers script has not been
+    // called yet
+    if (result == CURLE_OK && req->on_headers != NULL && !req->is_headers_notified) {
+        treq_RequestHeadersCallback(req);
+    }
+
+    treq_BufferShrink(&req->content);
+
+    if (req->is_max_size_exceeded || result == CURLE_FILESIZE_EXCEEDED) {
+        treq_RequestDiscardContent(req);
+        treq_RequestSetError(req, Tcl_ObjPrintf("the response body exceeds the limit of %"
+            TCL_LL_MODIFIER "d bytes set by the -max_size option", req->max_size));
+    } else if (req->content.failed_size != 0) {
+        treq_RequestSetError(req, Tcl_ObjPrintf("failed to allocate %ld additional bytes in"
+            " the output buffer, current output buffer size is %ld", (long)req->content.failed_size,
+            (long)req->content.size));
+    } else if (req->content.spill_error != 0) {
+        treq_RequestSetError(req, Tcl_ObjPrintf("failed to write the response body to"
+            " a temporary file: %s", Tcl_ErrnoMsg(req->content.spill_error)));
+    } else if (req->write_error != NULL) {
+        treq_RequestSetError(req, req->write_error);
+        Tcl_DecrRefCount(req->write_error);
+        req->write_error = NULL;
+    } else if (result == CURLE_OK) {
+        req->state = TREQ_REQUEST_DONE;
+    } else {
+        req->state = TREQ_REQUEST_ERROR;
+    }
+
+    // The output file replaces the target file only if the request
+    // is successful. Errors of writing the file are reported as
+    // the request error.
+    if (req->output != NULL) {
+        if (req->state == TREQ_REQUEST_DONE || req->output->error != 0) {
+            Tcl_Obj *output_error = treq_OutputCommit(req->output);
+            if (output_error != NULL) {
+                treq_RequestSetError(req, output_error);
+            }
+        } else {
+            treq_OutputDiscard(req->output);
+        }
+    }
+
+    if (req->channel != NULL) {
+        treq_ChannelNotify(req->channel);
+    }
+
+    DBG2(printf("return: %s", (req->state == TREQ_REQUEST_DONE ? "ok" : "ERROR")));
+
+}
+
+int treq_RequestCanUseIoThread(treq_RequestType *req) {
+
+    // Requests with Tcl callbacks that curl can call during the transfer
+    // must be served by the thread that owns the interp
+    if (req->callback_debug != NULL || req->on_data != NULL || req->on_headers != NULL || req->channel != NULL) {
+        return 0;
+    }
+
+    // libcurl doesn't support sharing connections between concurrent
+    // threads. Requests that use a shared connection cache must stay
+    // in the thread that owns the share.
+    if (req->share != NULL && !treq_ShareIsThreadSafe(req->share)) {
+        return 0;
+    }
+
+    return 1;
+
+}
+
+// Sets the options that are the same for all requests. These options
+// are applied when a new easy handle is created or when a handle is
+// returned to the cache, and not when a request is created.
+void treq_RequestSetEasyBaseline(CURL *curl_easy) {
+    // Set a callback to save output data
+    curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, treq_write_callback);
+    // Set our callback for debug messages
+    curl_easy_setopt(curl_easy, CURLOPT_DEBUGFUNCTION, treq_debug_callback);
+    // Turn off signals
+    curl_easy_setopt(curl_easy, CURLOPT_NOSIGNAL, 1L);
+    // Enable all supported compression methods
+    curl_easy_setopt(curl_easy, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+void treq_RequestSetRateLimit(treq_RequestType *req, treq_RateLimitType *rl) {
+    treq_RateLimitIncrRefCount(rl);
+    if (req->rate_limit != NULL) {
+        treq_RateLimitDecrRefCount(req->rate_limit);
+    }
+    req->rate_limit = rl;
+}
+
+// Continues the transfer paused by the -on_data script. Curl can deliver
+// the pending data to the script right away, and the script can pause
+// the transfer again.
+void treq_RequestResume(treq_RequestType *req) {
+
+    if (!req->is_paused) {
+        DBG2(printf("the request is not paused"));
+        return;
+    }
+
+    DBG2(printf("resume the transfer"));
+    req->is_paused = 0;
+    curl_easy_pause(req->curl_easy, CURLPAUSE_CONT);
+
+}
+
+// Returns the host name of the prepared request or an empty string
+// if the URL has no host
+const char *treq_RequestGetHost(treq_RequestType *req) {
+
+    if (req->host == NULL) {
+        if (req->curl_url == NULL || curl_url_get(req->curl_url, CURLUPART_HOST, &req->host, 0) != CURLUE_OK) {
+            return "";
+        }
+        DBG2(printf("request host: [%s]", req->host));
+    }
+
+    return req->host;
+
+}
+
+void treq_RequestSetShare(treq_RequestType *req, treq_ShareType *share) {
+
+    DBG2(printf("enter; req: %p share: %p", (void *)req, (void *)share));
+
+    treq_ShareIncrRefCount(share);
+    if (req->share != NULL) {
+        treq_ShareDecrRefCount(req->share);
+    }
+    req->share = share;
+
+    curl_easy_setopt(req->curl_easy, CURLOPT_SHARE, treq_ShareGetHandle(share));
+
+    DBG2(printf("return: ok"));
+
+}
+
 treq_RequestType *treq_RequestInit(void) {
 
     DBG2(printf("enter..."));
 
     treq_RequestType *req = ckalloc(sizeof(treq_RequestType));
     memset(req, 0, sizeof(treq_RequestType));
+    treq_BufferInit(&req->content);
+    req->max_size = -1;
 
-    req->curl_easy = curl_easy_init();
+    // The handle already has the baseline options,
+    // see treq_RequestSetEasyBaseline()
+    req->curl_easy = treq_EasyCacheGet();
     if (req->curl_easy == NULL) {
         goto error;
     }
 
     // Set a buffer for cURL errors
     curl_easy_setopt(req->curl_easy, CURLOPT_ERRORBUFFER, req->curl_error);
-    // Set a callback to save output data
-    curl_easy_setopt(req->curl_easy, CURLOPT_WRITEFUNCTION, treq_write_callback);
+    // Set user data for the callback to save output data
     curl_easy_setopt(req->curl_easy, CURLOPT_WRITEDATA, (void *)req);
     // This data will be used when we get a callback from curl and we need
     // to know the corresponding treq_RequestType struct
     curl_easy_setopt(req->curl_easy, CURLOPT_PRIVATE, (void *)req);
-    // Set our callback for debug messages
-    curl_easy_setopt(req->curl_easy, CURLOPT_DEBUGFUNCTION, treq_debug_callback);
+    // Set user data for the callback for debug messages
     curl_easy_setopt(req->curl_easy, CURLOPT_DEBUGDATA, (void *)req);
-    // Turn off signals
-    curl_easy_setopt(req->curl_easy, CURLOPT_NOSIGNAL, 1L);
-    // Enable all supported compression methods
-    curl_easy_setopt(req->curl_easy, CURLOPT_ACCEPT_ENCODING, "");
+
+    req->priority = -1;
+    req->deadline = -1;
+    req->queue_index = -1;
 
     req->state = TREQ_REQUEST_CREATED;
 
@@ -736,14 +1547,51 @@ error:
 
 }
 
+typedef struct treq_RequestAwaitResumeType {
+    Tcl_Interp *interp;
+    Tcl_Obj *coro;
+} treq_RequestAwaitResumeType;
+
+// Resumes the coroutine that awaited a destroyed request. The request
+// command no longer exists at this point, so ::trequests::await returns
+// an error in the coroutine.
+static void treq_RequestAwaitResumeProc(ClientData clientData) {
+
+    treq_RequestAwaitResumeType *resume = (treq_RequestAwaitResumeType *)clientData;
+    Tcl_Interp *interp = resume->interp;
+
+    DBG2(printf("enter; coroutine: %s", Tcl_GetString(resume->coro)));
+
+    Tcl_CmdInfo info;
+    if (!Tcl_InterpDeleted(interp) && Tcl_GetCommandInfo(interp, Tcl_GetString(resume->coro), &info)) {
+        Tcl_InterpState state = Tcl_SaveInterpState(interp, TCL_OK);
+        treq_RequestEvalObjv(interp, 1, &resume->coro, TCL_EVAL_GLOBAL);
+        Tcl_RestoreInterpState(interp, state);
+    }
+
+    Tcl_DecrRefCount(resume->coro);
+    Tcl_Release(interp);
+    ckfree(resume);
+
+    DBG2(printf("return: ok"));
+
+}
+
 void treq_RequestFree(treq_RequestType *req) {
 
     DBG2(printf("enter; req: %p", (void *)req));
 
-    // If we have a callback event bound to this request, make sure
-    // the callback event does not use a freed request.
-    if (req->callback_event != NULL) {
-        req->callback_event->request = NULL;
+    // The coroutine that awaits this request would never be resumed.
+    // Resume it when idle, as the request may be destroyed from places
+    // where running scripts is not safe.
+    if (req->await_coro != NULL && !Tcl_InterpDeleted(req->interp)) {
+        DBG2(printf("schedule resuming coroutine: %s", Tcl_GetString(req->await_coro)));
+        treq_RequestAwaitResumeType *resume = ckalloc(sizeof(treq_RequestAwaitResumeType));
+        resume->interp = req->interp;
+        Tcl_Preserve(resume->interp);
+        resume->coro = req->await_coro;
+        req->await_coro = NULL;
+        Tcl_DoWhenIdle(treq_RequestAwaitResumeProc, (ClientData)resume);
     }
 
     if (req->session != NULL) {
@@ -753,9 +1601,31 @@ void treq_RequestFree(treq_RequestType *req) {
         treq_PoolRemoveRequest(req);
     }
 
+    // If the callbacks of this request are scheduled, make sure the callback
+    // event does not use a freed request. Note that removing the request
+    // from the pool can schedule callbacks. Thus, this should be done after
+    // the request has been removed from the pool.
+    if (req->is_callback_pending) {
+        treq_RequestCallbackRemove(TCL_TSD_INIT(&dataKey), req);
+    }
+
     if (req->curl_easy != NULL) {
-        curl_easy_cleanup(req->curl_easy);
+        treq_EasyCachePut(req->curl_easy);
+    }
+
+    // The easy handle has been detached from the share. Now we can
+    // release the share.
+    if (req->share != NULL) {
+        treq_ShareDecrRefCount(req->share);
+    }
+    if (req->rate_limit != NULL) {
+        treq_RateLimitDecrRefCount(req->rate_limit);
+    }
+
+    if (req->host != NULL) {
+        curl_free(req->host);
     }
+
     if (req->curl_url != NULL) {
         curl_url_cleanup(req->curl_url);
     }
@@ -772,8 +1642,16 @@ void treq_RequestFree(treq_RequestType *req) {
         treq_RequestAuthFree(req->auth);
     }
 
-    if (req->content != NULL) {
-        ckfree(req->content);
+    if (req->channel != NULL) {
+        treq_ChannelDetach(req->channel);
+    }
+
+    treq_BufferFree(&req->content);
+    Tcl_FreeObject(req->content_obj);
+    Tcl_FreeObject(req->text_obj);
+
+    if (req->output != NULL) {
+        treq_OutputFree(req->output);
     }
 
     Tcl_FreeObject(req->cmd_name);
@@ -781,6 +1659,12 @@ void treq_RequestFree(treq_RequestType *req) {
     Tcl_FreeObject(req->headers);
     Tcl_FreeObject(req->callback);
     Tcl_FreeObject(req->callback_debug);
+    Tcl_FreeObject(req->callback_batch);
+    Tcl_FreeObject(req->on_data);
+    Tcl_FreeObject(req->on_headers);
+    Tcl_FreeObject(req->write_error);
+    Tcl_FreeObject(req->variable);
+    Tcl_FreeObject(req->await_coro);
     Tcl_FreeObject(req->custom_method);
     Tcl_FreeObject(req->error);
     Tcl_FreeObject(req->content_type);
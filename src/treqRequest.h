@@ -7,6 +7,8 @@
 #define TREQUESTS_TREQREQUEST_H
 
 #include "common.h"
+#include "treqBuffer.h"
+#include "treqOutput.h"
 
 // Values of this enum must start at 1 to differentiate between NULL
 // and a real value
@@ -22,12 +24,18 @@ typedef enum {
 
 typedef enum {
     TREQ_REQUEST_CREATED,
+    TREQ_REQUEST_QUEUED,
     TREQ_REQUEST_INPROGRESS,
     TREQ_REQUEST_DONE,
     TREQ_REQUEST_ERROR
 } treq_RequestStateType;
 
-typedef struct treq_RequestEvent treq_RequestEvent;
+#define treq_RequestIsCompleted(req) \
+    ((req)->state == TREQ_REQUEST_DONE || (req)->state == TREQ_REQUEST_ERROR)
+
+// Default priority of requests. It is the default HTTP/2 stream weight
+// in curl.
+#define TREQ_REQUEST_PRIORITY_DEFAULT 16
 
 struct treq_RequestType {
 
@@ -46,6 +54,24 @@ struct treq_RequestType {
     treq_SessionType *session;
     int isDead;
 
+    // Membership in the lists of requests of the pool and the session
+    treq_RequestType *pool_prev;
+    treq_RequestType *pool_next;
+    treq_RequestType *session_prev;
+    treq_RequestType *session_next;
+
+    // The share object used by the request. The request holds
+    // a reference to it.
+    treq_ShareType *share;
+
+    // I/O thread that serves the transfer when the pool uses
+    // the off-thread engine. The other fields are managed by
+    // the I/O thread, see treqIoThread.h.
+    treq_IoThreadType *io_thread;
+    int io_state;
+    treq_RequestType *io_next;
+    CURLcode io_result;
+
     // Input parameters
 
     Tcl_Obj *url;
@@ -67,26 +93,113 @@ struct treq_RequestType {
 
     int allow_redirects;
     int verbose;
+    int fail_on_error;
     int timeout;
     int timeout_connect;
+    // The maximum size of the response body, or -1 if there is no limit
+    Tcl_WideInt max_size;
 
     int verify_host;
     int verify_peer;
     int verify_status;
 
     Tcl_Obj *callback;
-    treq_RequestEvent *callback_event;
+    // The batch callback of the pool, see treq_RequestEventProc()
+    Tcl_Obj *callback_batch;
+    // The callbacks are scheduled, and the request is in the list
+    // of requests to be processed by the callback event
+    int is_callback_pending;
+    Tcl_WideInt callback_batch_seq;
+    treq_RequestType *callback_prev;
+    treq_RequestType *callback_next;
     int async;
+    // The pool for async request. NULL means the default pool of
+    // the current thread.
+    treq_PoolType *async_pool;
+    // The priority of the request in the pool queue and its HTTP/2 stream
+    // weight (1-256), or -1 if not set
+    int priority;
+    // The absolute time in milliseconds by which the request should be
+    // started, or -1 if not set. It is used to order the pool queue.
+    Tcl_WideInt deadline;
+    // The position in the pool queue, or -1 if the request is not queued,
+    // and the sequence number to keep FIFO order for equal requests
+    Tcl_Size queue_index;
+    Tcl_WideInt queue_seq;
+
+    // The rate limiter of the session. The request holds a reference to it.
+    treq_RateLimitType *rate_limit;
+    // The host name of the URL, used by rate limiters
+    char *host;
+    // The request waits for rate limiter tokens in the pool
+    int is_held;
+    treq_RequestType *held_prev;
+    treq_RequestType *held_next;
+    // The request has a slot of the adaptive limiter of the pool
+    int is_host_limited;
+    // The number of bytes of the response buffer counted against
+    // the memory budget of the pool, and the flag that the transfer
+    // is paused because the budget is exhausted
+    Tcl_WideInt pool_memory;
+    int is_memory_paused;
 
     Tcl_Obj *callback_debug;
 
+    // The script that receives the response body in chunks instead of
+    // the buffer, see treq_RequestDataCallback()
+    Tcl_Obj *on_data;
+    // The transfer is paused by the -on_data script or by the channel
+    int is_paused;
+    // The -on_data script is running. The request cannot be destroyed
+    // while curl is calling us.
+    int is_on_data_running;
+    // The script that is called when the headers of the response are
+    // received, see treq_RequestHeadersCallback()
+    Tcl_Obj *on_headers;
+    int is_on_headers_running;
+    int is_headers_notified;
+    // The error of the write callback that is not related to curl,
+    // e.g. the error of the -on_data script. It is reported when
+    // the request is completed.
+    Tcl_Obj *write_error;
+
+    // The global variable that is set to the request handle command
+    // when an async request is completed
+    Tcl_Obj *variable;
+
+    // The coroutine that waits for the request in ::trequests::await.
+    // It is resumed with the request handle command when the request
+    // is completed.
+    Tcl_Obj *await_coro;
+
     // Output parameters
 
-    // We don't use Tcl_Obj or DString to store the content, as we don't want
-    // to crash on a memory allocation error. A memory allocation error is
-    // very likely when we download something unknown from network.
-    char *content;
-    Tcl_Size content_size;
+    // The response body, see treqBuffer.h
+    treq_BufferType content;
+    // The buffer has been presized from the Content-Length header
+    int is_content_presized;
+    // The number of bytes of the response body accepted by the write
+    // callback, and the flag that the body exceeds the -max_size limit.
+    // The flag is reported when the request is completed, as the write
+    // callback can be run by an I/O thread.
+    Tcl_WideInt received_size;
+    int is_max_size_exceeded;
+    // The byte array returned by $handle content for the completed request.
+    // When it is created, the buffer is released, and the object holds
+    // the only copy of the body.
+    Tcl_Obj *content_obj;
+    // The text returned by $handle text for the completed request. It is
+    // released when the encoding is changed.
+    Tcl_Obj *text_obj;
+    // The file that receives the response body instead of the buffer,
+    // see treqOutput.h
+    treq_OutputType *output;
+    // The channel that reads the response body, see treqChannel.c. After
+    // the channel is closed, the rest of the body is not accepted.
+    treq_ChannelType *channel;
+    int is_channel_closed;
+    // The channel waits for data in treq_PoolWaitRequests()
+    int is_channel_waiting;
 
     Tcl_Encoding encoding;
     Tcl_Obj *content_type;
@@ -108,7 +221,17 @@ extern "C" {
 
 treq_RequestType *treq_RequestInit(void);
 void treq_RequestFree(treq_RequestType *req);
+int treq_RequestPrepare(treq_RequestType *req);
 void treq_RequestRun(treq_RequestType *req);
+void treq_RequestComplete(treq_RequestType *req, CURLcode result);
+void treq_RequestSetEasyBaseline(CURL *curl_easy);
+void treq_RequestSetShare(treq_RequestType *req, treq_ShareType *share);
+void treq_RequestSetRateLimit(treq_RequestType *req, treq_RateLimitType *rl);
+void treq_RequestResume(treq_RequestType *req);
+int treq_RequestReleaseContentObj(treq_RequestType *req);
+const char *treq_RequestGetHost(treq_RequestType *req);
+
+int treq_RequestCanUseIoThread(treq_RequestType *req);
 
 treq_RequestGetterProc treq_RequestGetError;
 treq_RequestGetterProc treq_RequestGetContent;
@@ -124,6 +247,7 @@ void treq_RequestSetError(treq_RequestType *req, Tcl_Obj *error);
 void treq_RequestSetEncoding(treq_RequestType *req, Tcl_Encoding encoding);
 
 void treq_RequestScheduleCallback(treq_RequestType *req);
+void treq_RequestThreadExitProc(void);
 
 const char *treq_RequestGetMethodName(treq_RequestMethodType method);
 
@@ -7,6 +7,7 @@
 #include "treqSession.h"
 #include "treqRequest.h"
 #include "treqRequestAuth.h"
+#include "treqRateLimit.h"
 
 typedef struct ThreadSpecificData {
 
@@ -16,25 +17,25 @@ typedef struct ThreadSpecificData {
 
 static Tcl_ThreadDataKey dataKey;
 
-treq_SessionType *treq_SessionInit(void) {
+// If share is NULL, the session will use its own share object. Otherwise,
+// the session takes ownership of the specified share reference.
+treq_SessionType *treq_SessionInit(treq_ShareType *share) {
 
-    DBG2(printf("enter..."));
+    DBG2(printf("enter; share: %p", (void *)share));
 
     treq_SessionType *ses = ckalloc(sizeof(treq_SessionType));
     memset(ses, 0, sizeof(treq_SessionType));
 
-    ses->curl_share = curl_share_init();
-    if (ses->curl_share == NULL) {
-        goto error;
+    if (share != NULL) {
+        ses->share = share;
+    } else {
+        ses->share = treq_ShareInit(TREQ_SHARE_COOKIE | TREQ_SHARE_DNS | TREQ_SHARE_SSL |
+            TREQ_SHARE_CONNECT | TREQ_SHARE_PSL | TREQ_SHARE_HSTS);
+        if (ses->share == NULL) {
+            goto error;
+        }
     }
 
-    curl_share_setopt(ses->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
-    curl_share_setopt(ses->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
-    curl_share_setopt(ses->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
-    curl_share_setopt(ses->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
-    curl_share_setopt(ses->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_PSL);
-    curl_share_setopt(ses->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_HSTS);
-
     DBG2(printf("return: %p", (void *)ses));
     return ses;
 
@@ -55,11 +56,15 @@ treq_RequestType *treq_SessionRequestInit(treq_SessionType *ses) {
     }
 
     req->session = ses;
-    curl_easy_setopt(req->curl_easy, CURLOPT_SHARE, ses->curl_share);
+    treq_RequestSetShare(req, ses->share);
     // Turn on cookie parser
     curl_easy_setopt(req->curl_easy, CURLOPT_COOKIEFILE, "");
 
-    treq_LinkedListInsertNewItem(ses->requests, req);
+    if (ses->rate_limit != NULL) {
+        treq_RequestSetRateLimit(req, ses->rate_limit);
+    }
+
+    treq_ListInsert(ses->requests, req, session);
 
     DBG2(printf("return: %p", (void *)req));
     return req;
@@ -73,7 +78,7 @@ void treq_SessionRemoveRequest(treq_RequestType *req) {
     DBG2(printf("enter; ses: %p remove: %p", (void *)ses, (void *)req));
 
     req->session = NULL;
-    treq_LinkedListRemoveByItem(ses->requests, req);
+    treq_ListRemove(ses->requests, req, session);
 
     DBG2(printf("return: ok"));
 
@@ -85,14 +90,16 @@ void treq_SessionFree(treq_SessionType *ses) {
 
     DBG2(printf("cleanup session requests"));
 
-    treq_LinkedListFree(ses->requests) {
-        DBG2(printf("cleanup request: %p", (void *)ses->requests->item));
-        ((treq_RequestType *)ses->requests->item)->session = NULL;
-        treq_RequestFree((treq_RequestType *)ses->requests->item);
+    treq_RequestType *req;
+    while ((req = ses->requests) != NULL) {
+        DBG2(printf("cleanup request: %p", (void *)req));
+        treq_ListRemove(ses->requests, req, session);
+        req->session = NULL;
+        treq_RequestFree(req);
     }
 
-    if (ses->curl_share != NULL) {
-        curl_share_cleanup(ses->curl_share);
+    if (ses->share != NULL) {
+        treq_ShareDecrRefCount(ses->share);
     }
 
     Tcl_FreeObject(ses->headers);
@@ -100,11 +107,16 @@ void treq_SessionFree(treq_SessionType *ses) {
     Tcl_FreeObject(ses->callback_debug);
     Tcl_FreeObject(ses->accept);
     Tcl_FreeObject(ses->content_type);
+    Tcl_FreeObject(ses->pool);
 
     if (ses->auth != NULL) {
         treq_RequestAuthFree(ses->auth);
     }
 
+    if (ses->rate_limit != NULL) {
+        treq_RateLimitDecrRefCount(ses->rate_limit);
+    }
+
     ckfree(ses);
 
     DBG2(printf("return: ok"));
@@ -7,6 +7,7 @@
 #define TREQUESTS_TREQSESSION_H
 
 #include "common.h"
+#include "treqShare.h"
 
 typedef struct treq_SessionRequestsListType treq_SessionRequestsListType;
 
@@ -14,31 +15,36 @@ struct treq_SessionType {
     Tcl_Interp *interp;
     Tcl_Command cmd_token;
 
-    CURLSH *curl_share;
+    treq_ShareType *share;
 
     Tcl_Obj *headers;
     treq_RequestAuthType *auth;
     int allow_redirects;
     int verbose;
+    int fail_on_error;
     Tcl_Obj *callback;
     Tcl_Obj *callback_debug;
     Tcl_Obj *accept;
     Tcl_Obj *content_type;
     int timeout;
     int timeout_connect;
+    int spill_threshold;
+    Tcl_WideInt max_size;
     int verify;
     int verify_host;
     int verify_peer;
     int verify_status;
+    Tcl_Obj *pool;
+    treq_RateLimitType *rate_limit;
 
-    treq_LinkedListType *requests;
+    treq_RequestType *requests;
 };
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-treq_SessionType *treq_SessionInit(void);
+treq_SessionType *treq_SessionInit(treq_ShareType *share);
 treq_RequestType *treq_SessionRequestInit(treq_SessionType *ses);
 void treq_SessionRemoveRequest(treq_RequestType *req);
 void treq_SessionFree(treq_SessionType *ses);
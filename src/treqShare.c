@@ -0,0 +1,414 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqShare.h"
+
+struct treq_ShareType {
+
+    CURLSH *curl_share;
+    int scope;
+
+    // Locks for each type of shared data. They are used by curl
+    // through the lock/unlock callbacks.
+    Tcl_Mutex locks[CURL_LOCK_DATA_LAST];
+
+    // The thread that created the share. libcurl doesn't support sharing
+    // connections between concurrent threads. If the share has
+    // the connection cache, it can only be used in this thread.
+    Tcl_ThreadId owner;
+
+    // The reference count is modified by different threads when the share
+    // belongs to a share group
+    int refcount;
+    Tcl_Mutex refcount_mx;
+
+};
+
+// Registry of share groups. Keys are group names and values are shares.
+// The registry holds a reference to each share.
+static struct {
+    int is_initialized;
+    Tcl_HashTable groups;
+    Tcl_Mutex mx;
+} registry = { 0 };
+
+// Default share for requests that are not part of a session. It is
+// disabled by default and can be enabled for each thread separately.
+typedef struct ThreadSpecificData {
+
+    treq_ShareType *share_default;
+
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+static const struct {
+    const char *name;
+    int scope;
+} share_scopes[] = {
+    { "cookie",  TREQ_SHARE_COOKIE  },
+    { "dns",     TREQ_SHARE_DNS     },
+    { "ssl",     TREQ_SHARE_SSL     },
+    { "connect", TREQ_SHARE_CONNECT },
+    { "psl",     TREQ_SHARE_PSL     },
+    { "hsts",    TREQ_SHARE_HSTS    },
+    { NULL }
+};
+
+static void treq_ShareLockCallback(CURL *handle, curl_lock_data data, curl_lock_access access, void *clientp) {
+    UNUSED(handle);
+    UNUSED(access);
+    Tcl_MutexLock(&((treq_ShareType *)clientp)->locks[data]);
+}
+
+static void treq_ShareUnlockCallback(CURL *handle, curl_lock_data data, void *clientp) {
+    UNUSED(handle);
+    Tcl_MutexUnlock(&((treq_ShareType *)clientp)->locks[data]);
+}
+
+treq_ShareType *treq_ShareInit(int scope) {
+
+    DBG2(printf("enter; scope: %d", scope));
+
+    treq_ShareType *share = ckalloc(sizeof(treq_ShareType));
+    memset(share, 0, sizeof(treq_ShareType));
+
+    share->curl_share = curl_share_init();
+    if (share->curl_share == NULL) {
+        ckfree(share);
+        DBG2(printf("return: ERROR (failed to alloc)"));
+        return NULL;
+    }
+
+    share->scope = scope;
+    share->owner = Tcl_GetCurrentThread();
+    share->refcount = 1;
+
+    curl_share_setopt(share->curl_share, CURLSHOPT_LOCKFUNC, treq_ShareLockCallback);
+    curl_share_setopt(share->curl_share, CURLSHOPT_UNLOCKFUNC, treq_ShareUnlockCallback);
+    curl_share_setopt(share->curl_share, CURLSHOPT_USERDATA, (void *)share);
+
+    if (scope & TREQ_SHARE_COOKIE) {
+        curl_share_setopt(share->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+    }
+    if (scope & TREQ_SHARE_DNS) {
+        curl_share_setopt(share->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+    if (scope & TREQ_SHARE_SSL) {
+        curl_share_setopt(share->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    if (scope & TREQ_SHARE_CONNECT) {
+        curl_share_setopt(share->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+    if (scope & TREQ_SHARE_PSL) {
+        curl_share_setopt(share->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_PSL);
+    }
+    if (scope & TREQ_SHARE_HSTS) {
+        curl_share_setopt(share->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_HSTS);
+    }
+
+    DBG2(printf("return: ok (%p)", (void *)share));
+    return share;
+
+}
+
+void treq_ShareIncrRefCount(treq_ShareType *share) {
+    Tcl_MutexLock(&share->refcount_mx);
+    share->refcount++;
+    Tcl_MutexUnlock(&share->refcount_mx);
+}
+
+void treq_ShareDecrRefCount(treq_ShareType *share) {
+
+    Tcl_MutexLock(&share->refcount_mx);
+    int refcount = --share->refcount;
+    Tcl_MutexUnlock(&share->refcount_mx);
+
+    if (refcount > 0) {
+        return;
+    }
+
+    DBG2(printf("free share: %p", (void *)share));
+
+    curl_share_cleanup(share->curl_share);
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        Tcl_MutexFinalize(&share->locks[i]);
+    }
+    Tcl_MutexFinalize(&share->refcount_mx);
+
+    ckfree(share);
+
+}
+
+CURLSH *treq_ShareGetHandle(treq_ShareType *share) {
+    return share->curl_share;
+}
+
+// Returns true if requests with this share can be served by any thread
+int treq_ShareIsThreadSafe(treq_ShareType *share) {
+    return !(share->scope & TREQ_SHARE_CONNECT);
+}
+
+int treq_ShareScopeFromObj(Tcl_Interp *interp, Tcl_Obj *obj, int *scope_ptr) {
+
+    Tcl_Size objc;
+    Tcl_Obj **objv;
+    if (Tcl_ListObjGetElements(interp, obj, &objc, &objv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (objc == 0) {
+        SetResult("share scope is expected to be a non-empty list");
+        return TCL_ERROR;
+    }
+
+    int scope = 0;
+
+    for (Tcl_Size i = 0; i < objc; i++) {
+        int idx;
+        if (Tcl_GetIndexFromObjStruct(interp, objv[i], share_scopes, sizeof(share_scopes[0]), "share scope", 0, &idx) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        scope |= share_scopes[idx].scope;
+    }
+
+    *scope_ptr = scope;
+    return TCL_OK;
+
+}
+
+Tcl_Obj *treq_ShareScopeToObj(int scope) {
+
+    Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+
+    for (int i = 0; share_scopes[i].name != NULL; i++) {
+        if (scope & share_scopes[i].scope) {
+            Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(share_scopes[i].name, -1));
+        }
+    }
+
+    return result;
+
+}
+
+int treq_ShareDefaultSetScope(Tcl_Interp *interp, Tcl_Obj *scope_obj) {
+
+    DBG2(printf("enter; scope: [%s]", Tcl_GetString(scope_obj)));
+
+    Tcl_Size length;
+    if (Tcl_ListObjLength(interp, scope_obj, &length) != TCL_OK) {
+        DBG2(printf("return: ERROR (not a list)"));
+        return TCL_ERROR;
+    }
+
+    treq_ShareType *share = NULL;
+
+    // An empty list disables the default share
+    if (length != 0) {
+
+        int scope;
+        if (treq_ShareScopeFromObj(interp, scope_obj, &scope) != TCL_OK) {
+            DBG2(printf("return: ERROR (wrong scope)"));
+            return TCL_ERROR;
+        }
+
+        share = treq_ShareInit(scope);
+        if (share == NULL) {
+            SetResult("failed to create a share");
+            DBG2(printf("return: ERROR (failed to alloc)"));
+            return TCL_ERROR;
+        }
+
+    }
+
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    // Existing requests keep their references to the previous share
+    if (tsdPtr->share_default != NULL) {
+        treq_ShareDecrRefCount(tsdPtr->share_default);
+    }
+
+    tsdPtr->share_default = share;
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
+Tcl_Obj *treq_ShareDefaultGetScope(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    return treq_ShareScopeToObj(tsdPtr->share_default == NULL ? 0 : tsdPtr->share_default->scope);
+}
+
+treq_ShareType *treq_ShareDefaultGet(void) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    return tsdPtr->share_default;
+}
+
+void treq_ShareThreadExitProc(void) {
+
+    DBG2(printf("enter..."));
+
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (tsdPtr->share_default != NULL) {
+        treq_ShareDecrRefCount(tsdPtr->share_default);
+        tsdPtr->share_default = NULL;
+    }
+
+    DBG2(printf("return: ok"));
+
+}
+
+int treq_ShareGroupCreate(Tcl_Interp *interp, Tcl_Obj *name, int scope) {
+
+    DBG2(printf("enter; name: [%s] scope: %d", Tcl_GetString(name), scope));
+
+    int rc = TCL_OK;
+
+    Tcl_MutexLock(&registry.mx);
+
+    if (!registry.is_initialized) {
+        Tcl_InitHashTable(&registry.groups, TCL_STRING_KEYS);
+        registry.is_initialized = 1;
+    }
+
+    int is_new;
+    Tcl_HashEntry *entry = Tcl_CreateHashEntry(&registry.groups, Tcl_GetString(name), &is_new);
+
+    if (!is_new) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("share group \"%s\" already exists",
+            Tcl_GetString(name)));
+        DBG2(printf("return: ERROR (already exists)"));
+        rc = TCL_ERROR;
+        goto done;
+    }
+
+    treq_ShareType *share = treq_ShareInit(scope);
+    if (share == NULL) {
+        Tcl_DeleteHashEntry(entry);
+        SetResult("failed to create a share group");
+        DBG2(printf("return: ERROR (failed to alloc)"));
+        rc = TCL_ERROR;
+        goto done;
+    }
+
+    Tcl_SetHashValue(entry, share);
+
+    DBG2(printf("return: ok"));
+
+done:
+    Tcl_MutexUnlock(&registry.mx);
+    return rc;
+
+}
+
+int treq_ShareGroupDestroy(Tcl_Interp *interp, Tcl_Obj *name) {
+
+    DBG2(printf("enter; name: [%s]", Tcl_GetString(name)));
+
+    treq_ShareType *share = NULL;
+
+    Tcl_MutexLock(&registry.mx);
+    if (registry.is_initialized) {
+        Tcl_HashEntry *entry = Tcl_FindHashEntry(&registry.groups, Tcl_GetString(name));
+        if (entry != NULL) {
+            share = (treq_ShareType *)Tcl_GetHashValue(entry);
+            Tcl_DeleteHashEntry(entry);
+        }
+    }
+    Tcl_MutexUnlock(&registry.mx);
+
+    if (share == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown share group \"%s\"",
+            Tcl_GetString(name)));
+        DBG2(printf("return: ERROR (unknown group)"));
+        return TCL_ERROR;
+    }
+
+    // The share will be released when the last session that uses
+    // the share is destroyed
+    treq_ShareDecrRefCount(share);
+
+    DBG2(printf("return: ok"));
+    return TCL_OK;
+
+}
+
+// Returns a share for the specified group with incremented reference count
+treq_ShareType *treq_ShareGroupGet(Tcl_Interp *interp, Tcl_Obj *name) {
+
+    DBG2(printf("enter; name: [%s]", Tcl_GetString(name)));
+
+    treq_ShareType *share = NULL;
+
+    Tcl_MutexLock(&registry.mx);
+    if (registry.is_initialized) {
+        Tcl_HashEntry *entry = Tcl_FindHashEntry(&registry.groups, Tcl_GetString(name));
+        if (entry != NULL) {
+            share = (treq_ShareType *)Tcl_GetHashValue(entry);
+            treq_ShareIncrRefCount(share);
+        }
+    }
+    Tcl_MutexUnlock(&registry.mx);
+
+    if (share == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown share group \"%s\"",
+            Tcl_GetString(name)));
+        DBG2(printf("return: ERROR (unknown group)"));
+        return NULL;
+    }
+
+    if (!treq_ShareIsThreadSafe(share) && share->owner != Tcl_GetCurrentThread()) {
+        treq_ShareDecrRefCount(share);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("share group \"%s\" shares connections"
+            " and can only be used in the thread where it was created", Tcl_GetString(name)));
+        DBG2(printf("return: ERROR (wrong thread)"));
+        return NULL;
+    }
+
+    DBG2(printf("return: ok (%p)", (void *)share));
+    return share;
+
+}
+
+Tcl_Obj *treq_ShareGroupNames(void) {
+
+    Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+
+    Tcl_MutexLock(&registry.mx);
+    if (registry.is_initialized) {
+        Tcl_HashSearch search;
+        for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&registry.groups, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+            Tcl_ListObjAppendElement(NULL, result,
+                Tcl_NewStringObj(Tcl_GetHashKey(&registry.groups, entry), -1));
+        }
+    }
+    Tcl_MutexUnlock(&registry.mx);
+
+    return result;
+
+}
+
+void treq_ShareGroupExitProc(void) {
+
+    DBG2(printf("enter..."));
+
+    Tcl_MutexLock(&registry.mx);
+    if (registry.is_initialized) {
+        Tcl_HashSearch search;
+        for (Tcl_HashEntry *entry = Tcl_FirstHashEntry(&registry.groups, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+            treq_ShareDecrRefCount((treq_ShareType *)Tcl_GetHashValue(entry));
+        }
+        Tcl_DeleteHashTable(&registry.groups);
+        registry.is_initialized = 0;
+    }
+    Tcl_MutexUnlock(&registry.mx);
+
+    DBG2(printf("return: ok"));
+
+}
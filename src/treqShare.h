@@ -0,0 +1,50 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQSHARE_H
+#define TREQUESTS_TREQSHARE_H
+
+#include "common.h"
+
+// Types of data that can be shared by a share object
+#define TREQ_SHARE_COOKIE  (1 << 0)
+#define TREQ_SHARE_DNS     (1 << 1)
+#define TREQ_SHARE_SSL     (1 << 2)
+#define TREQ_SHARE_CONNECT (1 << 3)
+#define TREQ_SHARE_PSL     (1 << 4)
+#define TREQ_SHARE_HSTS    (1 << 5)
+
+// Scope of a share group if it is not specified
+#define TREQ_SHARE_GROUP_DEFAULT_SCOPE (TREQ_SHARE_DNS | TREQ_SHARE_SSL | TREQ_SHARE_CONNECT)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+treq_ShareType *treq_ShareInit(int scope);
+void treq_ShareIncrRefCount(treq_ShareType *share);
+void treq_ShareDecrRefCount(treq_ShareType *share);
+CURLSH *treq_ShareGetHandle(treq_ShareType *share);
+int treq_ShareIsThreadSafe(treq_ShareType *share);
+
+int treq_ShareScopeFromObj(Tcl_Interp *interp, Tcl_Obj *obj, int *scope_ptr);
+Tcl_Obj *treq_ShareScopeToObj(int scope);
+
+int treq_ShareDefaultSetScope(Tcl_Interp *interp, Tcl_Obj *scope);
+Tcl_Obj *treq_ShareDefaultGetScope(void);
+treq_ShareType *treq_ShareDefaultGet(void);
+void treq_ShareThreadExitProc(void);
+
+int treq_ShareGroupCreate(Tcl_Interp *interp, Tcl_Obj *name, int scope);
+int treq_ShareGroupDestroy(Tcl_Interp *interp, Tcl_Obj *name);
+treq_ShareType *treq_ShareGroupGet(Tcl_Interp *interp, Tcl_Obj *name);
+Tcl_Obj *treq_ShareGroupNames(void);
+void treq_ShareGroupExitProc(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQSHARE_H
@@ -0,0 +1,123 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "treqUtf8.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Checks whether a response body can be used as a Tcl string as is,
+// without conversion by Tcl_ExternalToUtfDString(). Tcl represents NUL
+// as 0xC0 0x80, and Tcl 8.6 represents characters outside the BMP as
+// surrogate pairs, so such bodies must be converted.
+//
+// Text bodies are mostly ASCII, so ASCII runs are skipped by blocks of
+// 32 (AVX2) or 16 (SSE2) bytes, when it is enabled by the compiler, and
+// other characters are validated one by one.
+
+// Returns the length of the prefix that consists of ASCII characters
+// other than NUL
+static Tcl_Size treq_Utf8AsciiPrefix(const unsigned char *data, Tcl_Size size) {
+
+    Tcl_Size i = 0;
+
+#if defined(__AVX2__)
+    const __m256i zero256 = _mm256_setzero_si256();
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        // The high bit is set for non-ASCII bytes and for NUL bytes
+        // after comparison with zero
+        if (_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, zero256))) != 0) {
+            break;
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i zero128 = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero128))) != 0) {
+            break;
+        }
+    }
+#endif
+
+    // The rest of the data, or the block with the first non-ASCII byte
+    while (i < size && data[i] != 0 && data[i] < 0x80) {
+        i++;
+    }
+
+    return i;
+
+}
+
+// Returns true if the data consists of ASCII characters other than NUL
+int treq_Utf8IsAscii(const char *data, Tcl_Size size) {
+    return (treq_Utf8AsciiPrefix((const unsigned char *)data, size) == size);
+}
+
+// Returns true if the data is valid UTF-8 that doesn't contain NUL and,
+// for Tcl 8.6, characters outside the BMP
+int treq_Utf8IsTclString(const char *data, Tcl_Size size) {
+
+    const unsigned char *ptr = (const unsigned char *)data;
+    Tcl_Size i = 0;
+
+    for (;;) {
+
+        i += treq_Utf8AsciiPrefix(ptr + i, size - i);
+        if (i == size) {
+            return 1;
+        }
+
+        unsigned char c = ptr[i];
+        // The allowed range of the second byte excludes overlong forms,
+        // surrogates and code points above U+10FFFF
+        unsigned char lo = 0x80, hi = 0xBF;
+        Tcl_Size len;
+
+        if (c >= 0xC2 && c <= 0xDF) {
+            len = 2;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            len = 3;
+            if (c == 0xE0) {
+                lo = 0xA0;
+            } else if (c == 0xED) {
+                hi = 0x9F;
+            }
+#if TCL_MAJOR_VERSION > 8
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            len = 4;
+            if (c == 0xF0) {
+                lo = 0x90;
+            } else if (c == 0xF4) {
+                hi = 0x8F;
+            }
+#endif
+        } else {
+            // NUL, a continuation byte or an unsupported lead byte
+            return 0;
+        }
+
+        if (size - i < len || ptr[i + 1] < lo || ptr[i + 1] > hi) {
+            return 0;
+        }
+
+        for (Tcl_Size k = 2; k < len; k++) {
+            if ((ptr[i + k] & 0xC0) != 0x80) {
+                return 0;
+            }
+        }
+
+        i += len;
+
+    }
+
+}
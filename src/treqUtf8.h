@@ -0,0 +1,22 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+#ifndef TREQUESTS_TREQUTF8_H
+#define TREQUESTS_TREQUTF8_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int treq_Utf8IsAscii(const char *data, Tcl_Size size);
+int treq_Utf8IsTclString(const char *data, Tcl_Size size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREQUESTS_TREQUTF8_H
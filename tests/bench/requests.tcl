@@ -0,0 +1,71 @@
+# Copyright Jerily LTD. All Rights Reserved.
+# SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+# SPDX-License-Identifier: MIT.
+
+# Stress benchmark for request bookkeeping in pools and sessions. It creates,
+# completes and destroys many async requests, and prints the time of each
+# phase for several numbers of requests. The time per request should stay
+# the same as the number of requests grows.
+#
+# Usage: tclsh requests.tcl ?url? ?max_count?
+#
+# By default, requests are sent to a closed local port, so that they
+# fail fast without network access.
+
+package require trequests
+
+set url [expr { [llength $argv] > 0 ? [lindex $argv 0] : "http://127.0.0.1:1" }]
+set max_count [expr { [llength $argv] > 1 ? [lindex $argv 1] : 100000 }]
+
+proc measure { script } {
+    set start [clock microseconds]
+    uplevel 1 $script
+    return [expr { [clock microseconds] - $start }]
+}
+
+proc report { phase count usec } {
+    puts [format "  %-22s %10.1f ms %8.2f us/request" $phase \
+        [expr { $usec / 1000.0 }] [expr { double($usec) / $count }]]
+}
+
+proc run { url count } {
+
+    puts "$count requests:"
+
+    # The Tcl notifier can't watch descriptors over FD_SETSIZE, so limit
+    # the number of transfers that are served at the same time
+    set pool [::trequests::pool create -max_in_flight 256]
+    set session [::trequests::session -pool $pool]
+
+    set requests [list]
+    report "create" $count [measure {
+        for { set i 0 } { $i < $count } { incr i } {
+            lappend requests [$session get $url -async]
+        }
+    }]
+
+    report "complete" $count [measure {
+        ::trequests::wait_all $requests
+        # Run the callback events of completed requests
+        update
+    }]
+
+    # Destroy every second request in the middle of the session,
+    # and then destroy the session with the rest of the requests.
+    report "destroy (half)" [expr { $count / 2 }] [measure {
+        foreach { request - } $requests {
+            $request destroy
+        }
+    }]
+
+    report "destroy (session)" [expr { $count - $count / 2 }] [measure {
+        $session destroy
+    }]
+
+    $pool destroy
+
+}
+
+for { set count [expr { $max_count / 4 }] } { $count <= $max_count } { set count [expr { $count * 2 }] } {
+    run $url $count
+}
@@ -56,3 +56,66 @@ proc httpbin { code req } {
 }
 
 
+
+# A minimal HTTP server in the current thread. It can only serve async
+# requests, as it needs the Tcl event loop. The path /bytes/N returns
+# N bytes without the Content-Length header, the path /status/N returns
+# an empty response with the specified status code, the path /error/N
+# returns the specified status code with a body, the path /hex/HEX
+# returns the bytes specified in hex as UTF-8 text. Returns the base URL
+# of the server.
+
+proc httpd_start { } {
+    set ::httpd_sock [socket -server httpd_accept -myaddr 127.0.0.1 0]
+    return "http://127.0.0.1:[lindex [fconfigure $::httpd_sock -sockname] 2]"
+}
+
+proc httpd_stop { } {
+    catch { close $::httpd_sock }
+    unset -nocomplain ::httpd_sock
+}
+
+proc httpd_accept { chan addr port } {
+    fconfigure $chan -blocking 0 -translation crlf
+    fileevent $chan readable [list httpd_read $chan]
+}
+
+proc httpd_read { chan } {
+    while { [gets $chan line] > 0 } {
+        if { ![info exists ::httpd_request($chan)] } {
+            set ::httpd_request($chan) [lindex $line 1]
+        }
+    }
+    if { [eof $chan] } {
+        unset -nocomplain ::httpd_request($chan)
+        close $chan
+        return
+    }
+    if { [fblocked $chan] || ![info exists ::httpd_request($chan)] } return
+    set path $::httpd_request($chan)
+    unset ::httpd_request($chan)
+    fileevent $chan readable {}
+    set status 200
+    set body ""
+    set headers "Connection: close"
+    set arg [lindex [split $path /] end]
+    switch -glob -- $path {
+        /bytes/* { set body [string range [string repeat 0123456789 [expr { $arg / 10 + 1 }]] 0 $arg-1] }
+        /status/* { set status $arg }
+        /error/* {
+            set status $arg
+            set body "error body"
+        }
+        /hex/* {
+            set body [binary decode hex $arg]
+            append headers "\nContent-Type: text/plain; charset=utf-8"
+        }
+        default { set status 404 }
+    }
+    puts $chan "HTTP/1.1 $status Status\n$headers\n"
+    fconfigure $chan -translation binary
+    puts -nonewline $chan $body
+    # Closing a non-blocking channel flushes the pending data in
+    # the background
+    close $chan
+}